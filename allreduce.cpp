@@ -0,0 +1,170 @@
+#include "allreduce.hpp"
+
+#include <arpa/inet.h>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <thread>
+#include <unistd.h>
+
+static void check(bool ok, const string &what) {
+  if (!ok)
+    throw runtime_error("allreduce: " + what + ": " + strerror(errno));
+}
+
+static void set_options(int fd) {
+  int one = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  int flags = fcntl(fd, F_GETFL, 0);
+  check(fcntl(fd, F_SETFL, flags | O_NONBLOCK) == 0, "fcntl");
+}
+
+static int listen_on(int port) {
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  check(fd >= 0, "socket");
+  int one = 1;
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_ANY);
+  addr.sin_port = htons(port);
+  check(bind(fd, (sockaddr *)&addr, sizeof(addr)) == 0,
+        "bind port " + to_string(port));
+  check(listen(fd, 1) == 0, "listen");
+  return fd;
+}
+
+// retries until the peer listens or timeout seconds passed
+static int connect_to(const string &host, int port, double timeout) {
+  addrinfo hints, *res;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_STREAM;
+  if (getaddrinfo(host.c_str(), to_string(port).c_str(), &hints, &res) != 0)
+    throw runtime_error("allreduce: cannot resolve " + host);
+  auto deadline = chrono::steady_clock::now() +
+                  chrono::duration<double>(timeout);
+  for (;;) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    check(fd >= 0, "socket");
+    if (connect(fd, res->ai_addr, res->ai_addrlen) == 0) {
+      freeaddrinfo(res);
+      return fd;
+    }
+    close(fd);
+    if (chrono::steady_clock::now() > deadline) {
+      freeaddrinfo(res);
+      check(false, "connect to " + host + ":" + to_string(port));
+    }
+    this_thread::sleep_for(chrono::milliseconds(100));
+  }
+}
+
+AllReduce::AllReduce(int rank, int size, const vector<string> &hosts, int port,
+                     double timeout)
+    : rank_(rank), size_(size), send_fd(-1), recv_fd(-1) {
+  if (rank < 0 || rank >= size)
+    throw runtime_error("allreduce: rank out of range");
+  if (hosts.size() != 1 && hosts.size() != (size_t)size)
+    throw runtime_error("allreduce: need one host, or one host per rank");
+  if (size == 1)
+    return;
+  int next = (rank + 1) % size;
+  int listen_fd = listen_on(port + rank);
+  send_fd = connect_to(hosts[hosts.size() == 1 ? 0 : next], port + next,
+                       timeout);
+  recv_fd = accept(listen_fd, NULL, NULL);
+  check(recv_fd >= 0, "accept");
+  close(listen_fd);
+  set_options(send_fd);
+  set_options(recv_fd);
+}
+
+AllReduce::~AllReduce() {
+  if (send_fd >= 0)
+    close(send_fd);
+  if (recv_fd >= 0)
+    close(recv_fd);
+}
+
+void AllReduce::exchange(const double *send, size_t n_send, double *recv,
+                         size_t n_recv) {
+  const char *out = (const char *)send;
+  char *in = (char *)recv;
+  size_t n_out = n_send * sizeof(double), n_in = n_recv * sizeof(double);
+  while (n_out > 0 || n_in > 0) {
+    pollfd fds[2] = {{send_fd, short(n_out > 0 ? POLLOUT : 0), 0},
+                     {recv_fd, short(n_in > 0 ? POLLIN : 0), 0}};
+    if (poll(fds, 2, -1) < 0) {
+      check(errno == EINTR, "poll");
+      continue;
+    }
+    if (fds[0].revents & (POLLOUT | POLLERR | POLLHUP)) {
+      ssize_t n = ::send(send_fd, out, n_out, MSG_NOSIGNAL);
+      if (n > 0) {
+        out += n;
+        n_out -= n;
+      } else
+        check(errno == EAGAIN || errno == EINTR, "send");
+    }
+    if (fds[1].revents & (POLLIN | POLLERR | POLLHUP)) {
+      ssize_t n = ::recv(recv_fd, in, n_in, 0);
+      if (n == 0)
+        throw runtime_error("allreduce: peer closed the connection");
+      if (n > 0) {
+        in += n;
+        n_in -= n;
+      } else
+        check(errno == EAGAIN || errno == EINTR, "recv");
+    }
+  }
+}
+
+// Reduce-scatter, after which process r holds the sum of chunk r + 1,
+// then all-gather of the summed chunks; each process sends 2 (size - 1) / size
+// of the buffer in total, whatever the number of processes.
+void AllReduce::sum(double *data, size_t n) {
+  if (size_ == 1)
+    return;
+  vector<size_t> begin(size_ + 1);
+  for (int c = 0; c <= size_; ++c)
+    begin[c] = n * c / size_;
+  auto chunk = [&](int c) { return ((c % size_) + size_) % size_; };
+  auto length = [&](int c) { return begin[c + 1] - begin[c]; };
+  scratch.resize(n / size_ + 1);
+
+  for (int t = 0; t < size_ - 1; ++t) {
+    int s = chunk(rank_ - t), r = chunk(rank_ - t - 1);
+    exchange(data + begin[s], length(s), scratch.data(), length(r));
+    double *dst = data + begin[r];
+    for (size_t i = 0; i < length(r); ++i)
+      dst[i] += scratch[i];
+  }
+  for (int t = 0; t < size_ - 1; ++t) {
+    int s = chunk(rank_ + 1 - t), r = chunk(rank_ - t);
+    exchange(data + begin[s], length(s), data + begin[r], length(r));
+  }
+}
+
+shared_ptr<AllReduce> build_allreduce(const pt::ptree &options) {
+  auto size = options.get<int>("dist.size", 1);
+  if (size <= 1)
+    return NULL;
+  auto rank = options.get<int>("dist.rank", 0);
+  if (const char *env = getenv("GMM_RANK"))
+    rank = atoi(env);
+  vector<string> hosts;
+  stringstream ss(options.get<string>("dist.hosts", "127.0.0.1"));
+  for (string host; getline(ss, host, ',');)
+    hosts.push_back(host);
+  return make_shared<AllReduce>(rank, size, hosts,
+                                options.get<int>("dist.port", 29500),
+                                options.get<double>("dist.timeout", 60));
+}
@@ -0,0 +1,35 @@
+#pragma once
+
+#include "utils.hpp"
+
+// Sums buffers over the processes of one training job with a ring all-reduce
+// over TCP, so several local processes are enough to test it. Process rank
+// listens on port + rank of hosts[rank], sends to rank + 1 and receives from
+// rank - 1; every process ends with the same sum.
+class AllReduce {
+public:
+  AllReduce(int rank, int size, const vector<string> &hosts, int port,
+            double timeout);
+  ~AllReduce();
+
+  int rank() const { return rank_; }
+  int size() const { return size_; }
+
+  // in place; every process calls it with the same n
+  void sum(double *data, size_t n);
+  void sum(arma::vec &x) { sum(x.memptr(), x.n_elem); }
+
+private:
+  int rank_, size_;
+  int send_fd, recv_fd;
+  vector<double> scratch;
+
+  // sends to the next process while receiving from the previous one
+  void exchange(const double *send, size_t n_send, double *recv,
+                size_t n_recv);
+};
+
+// From the [dist] options: NULL unless dist.size > 1. The GMM_RANK
+// environment variable overrides dist.rank, so that every process of a job
+// can share one options.ini.
+shared_ptr<AllReduce> build_allreduce(const pt::ptree &options);
@@ -16,94 +16,93 @@ void compute_mean_var(VecOfMat &list, arma::mat &mean, arma::mat &var) {
   var /= (list.size() + 0.0);
 }
 
-shared_ptr<arma::mat> grad_bbvi_factorized(const pt::ptree &options,
-                                           const VecOfMat &grad_log_q,
-                                           const VecOfMat &log_p,
-                                           const VecOfMat &log_q,
-                                           BBVIStats &stats, int threads) {
-  auto n_rows = grad_log_q[0]->n_rows;
-  auto n_cols = grad_log_q[0]->n_cols;
-  size_t samples = options.get<int>("samples");
+void grad_bbvi_factorized(const pt::ptree &options,
+                          const arma::mat &grad_log_q, const arma::mat &log_p,
+                          const arma::mat &log_q, arma::vec &grad,
+                          BBVIStats &stats, int threads) {
+  arma::uword n_rows = grad_log_q.n_rows;
+  size_t samples = grad_log_q.n_cols;
   size_t covariate_samples = max((size_t)10, samples / 4);
-  assert(samples == grad_log_q.size());
   assert(samples > 10);
+  assert(log_p.n_cols == samples && n_rows % log_p.n_rows == 0);
+  arma::uword group_size = n_rows / log_p.n_rows;
+  bool entropy = log_q.n_elem > 0;
 
-  // compute the gradient
-  VecOfMat g_list;
-  g_list.resize(samples);
+  grad.set_size(n_rows);
+  arma::vec mean_g0(n_rows), var_g0(n_rows), var_g1(n_rows);
 
-  /* #pragma omp parallel for num_threads(threads) */
-  for (arma::uword s = 0; s < samples; ++s) {
-    shared_ptr<arma::mat> g(new arma::mat());
-    if (log_q[s]) {
-      auto elbo = *log_p[s] - *log_q[s];
-      auto grad_rows = grad_log_q[s]->n_rows;
-      if (log_p[s]->n_rows < grad_rows) {
-        *g = arma::repmat(elbo, grad_rows, 1) % (*grad_log_q[s]);
-      } else {
-        *g = (elbo) % (*grad_log_q[s]);
+  // Each task owns a block of rows and makes two passes over the samples
+  // with running sums: the first estimates the control variate coefficient,
+  // the second the gradient with and without it. Samples are summed in
+  // order, so the result does not depend on the number of threads.
+  const arma::uword block = 256;
+  arma::uword n_blocks = (n_rows + block - 1) / block;
+#pragma omp parallel num_threads(threads)
+  {
+    arma::mat acc(block, 4);
+#pragma omp for schedule(static)
+    for (arma::uword b = 0; b < n_blocks; ++b) {
+      arma::uword i0 = b * block;
+      arma::uword n = min(block, n_rows - i0);
+
+      // sum g, sum g^2, sum g h, sum h^2 with g = elbo * h over the
+      // covariate samples
+      acc.zeros();
+      for (arma::uword s = 0; s < covariate_samples; ++s) {
+        const double *h = grad_log_q.colptr(s) + i0;
+        for (arma::uword i = 0; i < n; ++i) {
+          arma::uword group = (i0 + i) / group_size;
+          double elbo = log_p(group, s) - (entropy ? log_q(group, s) : 0.0);
+          double g = elbo * h[i];
+          acc(i, 0) += g;
+          acc(i, 1) += g * g;
+          acc(i, 2) += g * h[i];
+          acc(i, 3) += h[i] * h[i];
+        }
       }
-    } else {
-      *g = (*log_p[s]) % (*grad_log_q[s]);
-    }
-    g_list[s] = g;
-  }
 
-  // compute covariate
-  arma::mat mean_g(n_rows, n_cols, arma::fill::zeros);
-  arma::mat mean_glq(n_rows, n_cols, arma::fill::zeros);
-  for (arma::uword s = 0; s < covariate_samples; ++s) {
-    mean_g += *g_list[s];
-    mean_glq += *grad_log_q[s];
-  }
-  mean_g /= (covariate_samples + 0.0);
-  mean_glq /= (covariate_samples + 0.0);
+      arma::vec a(n, arma::fill::zeros);
+      for (arma::uword i = 0; i < n; ++i) {
+        // note that E[grad_log_q] = 0, use the improved estimates
+        double mean_g = acc(i, 0) / covariate_samples;
+        double var_g = max(acc(i, 1) / covariate_samples - mean_g * mean_g, 0.0);
+        double cov = acc(i, 2) / covariate_samples;
+        double var_glq = acc(i, 3) / covariate_samples;
+        double rc = cov * cov / var_g / var_glq;
+        if (isfinite(rc) && (rc >= 0.5))
+          a(i) = cov / var_glq;
+      }
 
-  arma::mat cov(n_rows, n_cols, arma::fill::zeros);
-  arma::mat var_g(n_rows, n_cols, arma::fill::zeros);
-  arma::mat var_glq(n_rows, n_cols, arma::fill::zeros);
-  for (arma::uword s = 0; s < covariate_samples; ++s) {
-    // note that E[grad_log_q] = 0, use the improved estimates
-    cov += (*g_list[s]) % (*grad_log_q[s]);
-    var_g += (*g_list[s] - mean_g) % (*g_list[s] - mean_g);
-    var_glq += (*grad_log_q[s]) % (*grad_log_q[s]);
-  }
-  cov /= (covariate_samples + 0.0);
-  var_g /= (covariate_samples + 0.0);
-  var_glq /= (covariate_samples + 0.0);
+      // sum g0, sum g0^2, sum g1, sum g1^2 over the remaining samples, with
+      // g1 = g0 - a h
+      acc.zeros();
+      for (arma::uword s = covariate_samples; s < samples; ++s) {
+        const double *h = grad_log_q.colptr(s) + i0;
+        for (arma::uword i = 0; i < n; ++i) {
+          arma::uword group = (i0 + i) / group_size;
+          double elbo = log_p(group, s) - (entropy ? log_q(group, s) : 0.0);
+          double g0 = elbo * h[i];
+          double g1 = g0 - a(i) * h[i];
+          acc(i, 0) += g0;
+          acc(i, 1) += g0 * g0;
+          acc(i, 2) += g1;
+          acc(i, 3) += g1 * g1;
+        }
+      }
 
-  arma::mat rel_cov = cov % cov / var_g / var_glq;
-  arma::mat a(n_rows, n_cols, arma::fill::zeros);
-  for (arma::uword i = 0; i < n_rows; ++i) {
-    for (arma::uword j = 0; j < n_cols; ++j) {
-      auto rc = rel_cov(i, j);
-      if (isfinite(rc) && (rc >= 0.5))
-        a(i, j) = cov(i, j) / var_glq(i, j);
+      double m = samples - covariate_samples;
+      for (arma::uword i = 0; i < n; ++i) {
+        mean_g0(i0 + i) = acc(i, 0) / m;
+        var_g0(i0 + i) = acc(i, 1) / m - mean_g0(i0 + i) * mean_g0(i0 + i);
+        grad(i0 + i) = acc(i, 2) / m;
+        var_g1(i0 + i) = acc(i, 3) / m - grad(i0 + i) * grad(i0 + i);
+      }
     }
   }
 
-  // compute gradient
-  VecOfMat g0_list, g1_list;
-  g0_list.resize(samples - covariate_samples);
-  g1_list.resize(samples - covariate_samples);
-  /* #pragma omp parallel for num_threads(threads) */
-  for (arma::uword s = covariate_samples; s < samples; ++s) {
-    g0_list[s - covariate_samples] = g_list[s];
-    shared_ptr<arma::mat> g1(new arma::mat(n_rows, n_cols));
-    *g1 = *g_list[s] - a % (*grad_log_q[s]);
-    g1_list[s - covariate_samples] = g1;
-  }
-  arma::mat mean_g0, var_g0;
-  compute_mean_var(g0_list, mean_g0, var_g0);
-  arma::mat mean_g1, var_g1;
-  compute_mean_var(g1_list, mean_g1, var_g1);
-
   // statistics
-  auto mean_all = [](const arma::mat &m) { return arma::mean(arma::mean(m)); };
-  stats.mean_sqr_g0 = mean_all(mean_g0 % mean_g0);
-  stats.var_g0 = mean_all(var_g0);
-  stats.mean_sqr_g1 = mean_all(mean_g1 % mean_g1);
-  stats.var_g1 = mean_all(var_g1);
-
-  return shared_ptr<arma::mat>(new arma::mat(mean_g1));
+  stats.mean_sqr_g0 = arma::mean(mean_g0 % mean_g0);
+  stats.var_g0 = arma::mean(var_g0);
+  stats.mean_sqr_g1 = arma::mean(grad % grad);
+  stats.var_g1 = arma::mean(var_g1);
 }
@@ -28,8 +28,12 @@ struct BBVIStats {
 
 void compute_mean_var(VecOfMat &list, arma::mat &mean, arma::mat &var);
 
-shared_ptr<arma::mat> grad_bbvi_factorized(const pt::ptree &options,
-                                           const VecOfMat &grad_log_q,
-                                           const VecOfMat &log_p,
-                                           const VecOfMat &log_q,
-                                           BBVIStats &stats, int threads);
+// Score-function gradient with a control variate. grad_log_q holds the
+// scores of all samples, one per column [n, S]. log_p and log_q are [G, S];
+// row g weights score rows [g * n / G, (g + 1) * n / G), so G = 1 for global
+// latents. An empty log_q drops the entropy term. The mean gradient [n] is
+// written to grad.
+void grad_bbvi_factorized(const pt::ptree &options,
+                          const arma::mat &grad_log_q, const arma::mat &log_p,
+                          const arma::mat &log_q, arma::vec &grad,
+                          BBVIStats &stats, int threads);
@@ -0,0 +1,201 @@
+#include "bbvi.hpp"
+#include "data.hpp"
+#include "dirichlet.hpp"
+#include "gaussian_mixture.hpp"
+#include "normal.hpp"
+#include "optimizer.hpp"
+#include "profile.hpp"
+#include "random.hpp"
+#include "utils.hpp"
+#include "variational_inference.hpp"
+
+#include <algorithm>
+#include <boost/program_options.hpp>
+#include <cstdio>
+
+namespace po = boost::program_options;
+
+// Microbenchmarks of the hot kernels, on synthetic data of n examples in d
+// dimensions with k components, s Monte Carlo samples and minibatches of b.
+// Every kernel runs once to warm up and then reps times; the timings go to
+// a JSON file so that builds can be compared.
+struct Bench {
+  int reps;
+  string filter;
+  vector<string> results;
+
+  // items: what the kernel processes per run, e.g. draws or elements
+  template <class F> void run(const string &name, double items, F f) {
+    if (!filter.empty() && name.find(filter) == string::npos)
+      return;
+    f();
+    vector<double> seconds;
+    for (int r = 0; r < reps; ++r) {
+      Timer timer;
+      f();
+      seconds.push_back(timer.lap());
+    }
+    sort(seconds.begin(), seconds.end());
+    double median = seconds[seconds.size() / 2];
+    printf("%-28s median %10.3f us  min %10.3f us  %10.2f ns/item\n",
+           name.c_str(), median * 1e6, seconds[0] * 1e6, median / items * 1e9);
+    char buf[512];
+    snprintf(buf, sizeof(buf),
+             "{\"name\":\"%s\",\"items\":%.0f,\"median_s\":%.6g,"
+             "\"min_s\":%.6g,\"ns_per_item\":%.6g}",
+             name.c_str(), items, median, seconds[0], median / items * 1e9);
+    results.push_back(buf);
+  }
+};
+
+int main(int argc, char **argv) {
+  int n, d, k, s, b, threads, reps;
+  string out, filter, dir;
+  po::options_description desc("bench options");
+  desc.add_options()("help", "print the options")(
+      "n", po::value<int>(&n)->default_value(100000), "examples")(
+      "d", po::value<int>(&d)->default_value(16), "dimensions")(
+      "k", po::value<int>(&k)->default_value(10), "mixture components")(
+      "samples", po::value<int>(&s)->default_value(50), "Monte Carlo samples")(
+      "batch", po::value<int>(&b)->default_value(100), "minibatch size")(
+      "threads", po::value<int>(&threads)->default_value(1), "threads")(
+      "reps", po::value<int>(&reps)->default_value(20), "timed runs")(
+      "filter", po::value<string>(&filter)->default_value(""),
+      "only kernels whose name contains this")(
+      "out", po::value<string>(&out)->default_value("bench.json"),
+      "JSON results")("dir", po::value<string>(&dir)->default_value("/tmp"),
+                      "where the synthetic data file is written");
+  po::variables_map vm;
+  po::store(po::parse_command_line(argc, argv, desc), vm);
+  po::notify(vm);
+  if (vm.count("help")) {
+    cout << desc << endl;
+    return 0;
+  }
+
+  pt::ptree options;
+  options.put("seed", 1);
+  options.put("samples", s);
+  options.put("n_threads", threads);
+  options.put("batch_size", b);
+  options.put("data_dimension", d);
+  options.put("observations", true);
+  options.put("algo", "adagrad");
+  options.put("rho", 0.1);
+  options.put("tau", 10);
+  options.put("p.n_components", k);
+  options.put("p.init_alpha", 5);
+  options.put("p.init_scale", 10);
+  options.put("q.init_alpha", 1);
+  options.put("q.init_scale", 1);
+  options.put("q.learn_scale", true);
+  options.put("q.link_function", "softplus");
+
+  GSLRandom rng;
+  gsl_rng_set(rng.rng, 1);
+  Bench bench;
+  bench.reps = reps;
+  bench.filter = filter;
+
+  // densities
+  arma::mat z(d, k), loc(d, k, arma::fill::zeros), scale(d, k);
+  fill_normal(rng.rng, z.memptr(), z.n_elem);
+  scale.fill(2);
+  double sink = 0;
+  bench.run("normal_log_prob", z.n_elem,
+            [&]() { sink += normal_log_prob(z, loc, scale); });
+  arma::vec alpha(k), weights(k, arma::fill::ones);
+  alpha.fill(2);
+  weights /= k;
+  bench.run("dirichlet_lnpdf", k, [&]() {
+    sink += gsl_ran_dirichlet_lnpdf(k, alpha.memptr(), weights.memptr());
+  });
+
+  // sampling and scores of every draw
+  QNormal q_normal(options, d, k);
+  QDirichlet q_dirichlet(options);
+  Packed normal_z(q_normal.latent_layout, s),
+      normal_score(q_normal.score_layout, s);
+  Packed dirichlet_z(q_dirichlet.latent_layout, s),
+      dirichlet_score(q_dirichlet.score_layout, s);
+  bench.run("qnormal_sample", s * d * k, [&]() {
+    for (int i = 0; i < s; ++i)
+      q_normal.samples_into(rng.rng, normal_z, i);
+  });
+  bench.run("qdirichlet_sample", s * k, [&]() {
+    for (int i = 0; i < s; ++i)
+      q_dirichlet.samples_into(rng.rng, dirichlet_z, i);
+  });
+  bench.run("qdirichlet_sample_batch", s * k, [&]() {
+    q_dirichlet.samples_batch_into(rng.rng, dirichlet_z, NULL);
+  });
+  bench.run("qnormal_score", s * d * k,
+            [&]() { q_normal.grad_lq(normal_z, normal_score, threads); });
+  bench.run("qdirichlet_score", s * k, [&]() {
+    q_dirichlet.grad_lq(dirichlet_z, dirichlet_score, threads);
+  });
+
+  // score-function gradient with control variates
+  arma::mat log_p(1, s), log_q(1, s);
+  fill_normal(rng.rng, log_p.memptr(), s);
+  fill_normal(rng.rng, log_q.memptr(), s);
+  arma::vec grad;
+  BBVIStats stats;
+  bench.run("grad_bbvi_factorized", s * d * k, [&]() {
+    grad_bbvi_factorized(options, normal_score.draws(0), log_p, log_q, grad,
+                         stats, threads);
+  });
+
+  // one dense step of every rule
+  arma::mat g(d, k);
+  fill_normal(rng.rng, g.memptr(), g.n_elem);
+  for (string algo : {"adagrad", "rmsprop", "vsgd"}) {
+    options.put("algo", algo);
+    Serializable<arma::mat> w(d, k, arma::fill::zeros);
+    Optimizer optimizer(options, &w);
+    bench.run("optimizer_" + algo, d * k, [&]() { optimizer.update(g); });
+  }
+  options.put("algo", "adagrad");
+
+  // minibatches of a mapped dataset
+  string data_file = dir + "/gmm_bench_" + to_string(n) + "x" + to_string(d) +
+                     ".bin";
+  arma::mat x(d, n);
+  fill_normal(rng.rng, x.memptr(), x.n_elem);
+  save_binary_data(x, data_file);
+  options.put("data_file", data_file);
+  auto data = build_data("dense", options, data_file);
+  ExampleIds contiguous, scattered;
+  for (int j = 0; j < b; ++j) {
+    contiguous.push_back(j);
+    scattered.push_back(gsl_rng_get(rng.rng) % n);
+  }
+  bench.run("slice_data", b * d,
+            [&]() { sink += data->slice_data(scattered)->n_elem; });
+  bench.run("slice_view_contiguous", b * d,
+            [&]() { sink += data->slice_view(contiguous).n_elem; });
+  bench.run("slice_view_scattered", b * d,
+            [&]() { sink += data->slice_view(scattered).n_elem; });
+
+  // a full iteration of the mixture
+  PGaussianMixture p_mixture(options);
+  QGaussianMixture q_mixture(options);
+  VariationalInference vi(options, &p_mixture, &q_mixture, data);
+  bench.run("train_batch_global", s * b,
+            [&]() { vi.train_batch_global(scattered); });
+
+  FILE *f = fopen(out.c_str(), "w");
+  if (!f)
+    throw runtime_error("cannot write " + out);
+  fprintf(f,
+          "{\"config\":{\"n\":%d,\"d\":%d,\"k\":%d,\"samples\":%d,"
+          "\"batch\":%d,\"threads\":%d,\"reps\":%d},\"results\":[",
+          n, d, k, s, b, threads, reps);
+  for (size_t i = 0; i < bench.results.size(); ++i)
+    fprintf(f, i ? ",\n%s" : "\n%s", bench.results[i].c_str());
+  fprintf(f, "]}\n");
+  fclose(f);
+  remove(data_file.c_str());
+  // keeps the timed results from being optimized away
+  return sink == 0.123456789 ? 2 : 0;
+}
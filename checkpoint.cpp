@@ -0,0 +1,117 @@
+#include "checkpoint.hpp"
+
+#include <cerrno>
+#include <cstdio>
+#include <fcntl.h>
+#include <fstream>
+#include <unistd.h>
+
+void save_rng(const gsl_rng *rng, vector<char> &state) {
+  const char *mem = static_cast<const char *>(rng->state);
+  state.assign(mem, mem + rng->type->size);
+}
+
+void load_rng(gsl_rng *rng, const vector<char> &state) {
+  if (state.size() != rng->type->size)
+    throw runtime_error("checkpoint does not match the rng type");
+  memcpy(rng->state, state.data(), state.size());
+}
+
+Checkpointer::~Checkpointer() {
+  if (writer.joinable())
+    writer.join();
+}
+
+TrainState &Checkpointer::snapshot() {
+  wait();
+  return state;
+}
+
+void Checkpointer::save() {
+  wait();
+  writer = thread(&Checkpointer::write, this);
+}
+
+void Checkpointer::wait() {
+  if (writer.joinable())
+    writer.join();
+  if (!error.empty()) {
+    string e = error;
+    error.clear();
+    throw runtime_error(e);
+  }
+}
+
+void Checkpointer::write() {
+  try {
+    string tmp = path + ".tmp";
+    {
+      ofstream ofs(tmp, ios::binary);
+      boost::archive::binary_oarchive oa(ofs);
+      oa << state;
+      ofs.close();
+      if (!ofs)
+        throw runtime_error("cannot write checkpoint " + tmp);
+    }
+    int fd = open(tmp.c_str(), O_RDONLY);
+    if (fd >= 0) {
+      fsync(fd);
+      close(fd);
+    }
+    string prev = path + ".prev";
+    if (rename(path.c_str(), prev.c_str()) != 0 && errno != ENOENT)
+      throw runtime_error("cannot rename checkpoint to " + prev);
+    if (rename(tmp.c_str(), path.c_str()) != 0)
+      throw runtime_error("cannot rename checkpoint to " + path);
+  } catch (const exception &e) {
+    error = e.what();
+  }
+}
+
+bool Checkpointer::load(TrainState &state, bool previous) const {
+  ifstream ifs(previous ? path + ".prev" : path, ios::binary);
+  if (!ifs)
+    return false;
+  boost::archive::binary_iarchive ia(ifs);
+  ia >> state;
+  return true;
+}
+
+bool load_resume_state(const Checkpointer &checkpointer, AllReduce *allreduce,
+                       TrainState &state) {
+  TrainState prev;
+  bool found = checkpointer.load(state);
+  bool found_prev = checkpointer.load(prev, true);
+  // killed between the two renames: path.prev is the newest
+  if (!found && found_prev) {
+    state = move(prev);
+    found = true;
+    found_prev = false;
+  }
+  if (!allreduce)
+    return found;
+
+  // the iteration + 1 of every process's newest checkpoint, 0 for none
+  arma::vec iterations(allreduce->size(), arma::fill::zeros);
+  if (found)
+    iterations(allreduce->rank()) = state.iteration + 1;
+  allreduce->sum(iterations);
+  int iteration = (int)iterations.min() - 1;
+  if (iteration < 0)
+    return false;
+  if (state.iteration == iteration)
+    return true;
+  if (found_prev && prev.iteration == iteration) {
+    state = move(prev);
+    return true;
+  }
+  throw runtime_error("no checkpoint of iteration " + to_string(iteration) +
+                      " to resume every process from");
+}
+
+void checkpoint_barrier(AllReduce *allreduce) {
+  if (!allreduce)
+    return;
+  arma::vec token(1, arma::fill::zeros);
+  allreduce->sum(token);
+}
@@ -0,0 +1,82 @@
+#pragma once
+
+#include "allreduce.hpp"
+#include "optimizer.hpp"
+#include "utils.hpp"
+#include <gsl/gsl_rng.h>
+#include <thread>
+
+// Everything needed to resume training exactly after an iteration.
+struct TrainState {
+  int iteration;
+  // position in the minibatch order and in the stream of chunks
+  arma::uword batch_st, n_drawn, resident_begin;
+  vector<Optimizer::State> optimizers;
+  // raw state of the minibatch rng; older checkpoints also hold one per
+  // training thread after it
+  vector<vector<char>> rngs;
+
+  // version 0 stored batch_st as an int
+  template <class Archive>
+  void serialize(Archive &ar, const unsigned int version) {
+    ar &iteration;
+    if (version == 0) {
+      int st = batch_st;
+      ar &st;
+      batch_st = st;
+    } else {
+      ar &batch_st;
+    }
+    ar &n_drawn;
+    ar &resident_begin;
+    ar &optimizers;
+    ar &rngs;
+  }
+};
+
+BOOST_CLASS_VERSION(TrainState, 1)
+
+void save_rng(const gsl_rng *rng, vector<char> &state);
+void load_rng(gsl_rng *rng, const vector<char> &state);
+
+// Writes snapshots of the training state to a binary archive on a
+// background thread, so training only pays for the copy. Each file is
+// written to path.tmp and synced; then the previous checkpoint is renamed to
+// path.prev and the new one to path, so the last two checkpoints are always
+// complete even if the job is killed mid-write.
+class Checkpointer {
+public:
+  Checkpointer(const string &path) : path(path) {}
+  ~Checkpointer();
+
+  // the buffer to fill before save(); waits for the previous write first
+  TrainState &snapshot();
+  // starts writing the snapshot
+  void save();
+  // waits for the running write; rethrows its error
+  void wait();
+
+  // false if there is no checkpoint at path, or at path.prev if previous
+  bool load(TrainState &state, bool previous = false) const;
+
+private:
+  string path;
+  TrainState state;
+  thread writer;
+  string error;
+
+  void write();
+};
+
+// The checkpoint to resume from, false if there is none. Every process of a
+// job writes its own, so a job killed mid-write can leave them one
+// generation apart: all processes then load the newest iteration every one
+// of them has, which is still in path or path.prev since no process starts
+// a checkpoint before all finished the previous one (see
+// checkpoint_barrier). False on every process if one of them has none.
+bool load_resume_state(const Checkpointer &checkpointer, AllReduce *allreduce,
+                       TrainState &state);
+
+// waits until every process finished writing its previous checkpoint; call
+// after Checkpointer::snapshot()
+void checkpoint_barrier(AllReduce *allreduce);
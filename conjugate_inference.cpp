@@ -0,0 +1,338 @@
+#include "conjugate_inference.hpp"
+#include "profile.hpp"
+#include "variational_inference.hpp"
+
+#include <omp.h>
+
+ConjugateInference::ConjugateInference(pt::ptree &options, PGaussianMixture *p,
+                                       QGaussianMixture *q,
+                                       shared_ptr<Data> data)
+    : options(options), p(p), q(q), data(data) {
+  auto engine = options.get<string>("engine");
+  if (engine != "cavi" && engine != "svi")
+    throw runtime_error("unknown conjugate engine " + engine);
+  svi = engine == "svi";
+  allreduce = build_allreduce(options);
+  // each process only loads its own shard of the examples
+  if (!data)
+    this->data = build_data(options.get<string>("data_type", "dense"), options,
+                            options.get<string>("data_file"),
+                            allreduce ? allreduce->rank() : 0,
+                            allreduce ? allreduce->size() : 1);
+  n_examples = this->data->n_examples();
+  n_components = options.get<arma::uword>("p.n_components");
+  dimension = options.get<arma::uword>("data_dimension");
+  if (this->data->n_dim_y() != (int)dimension)
+    throw runtime_error("data_dimension does not match the data");
+  auto seed = options.get<int>("seed");
+  if (allreduce)
+    seed += allreduce->rank();
+  batch_rng = make_shared<GSLRandom>();
+  gsl_rng_set(batch_rng->rng, seed);
+  threads = options.get<int>("n_threads");
+  block_size = options.get<int>("conjugate.block_size", 4096);
+  kappa = options.get<double>("conjugate.kappa", 0.7);
+  delay = options.get<double>("conjugate.delay", 1.0);
+  stats.set_size(n_components + dimension * n_components + 1);
+  iteration = 0;
+}
+
+void ConjugateInference::init_locs() {
+  // rank 0 picks from its shard and the others add zeros
+  arma::vec locs(dimension * n_components, arma::fill::zeros);
+  if (!allreduce || allreduce->rank() == 0) {
+    GSLRandom rng;
+    gsl_rng_set(rng.rng, options.get<int>("seed"));
+    arma::uword resident = data->resident_size();
+    ExampleIds example_ids;
+    while (example_ids.size() < n_components) {
+      arma::uword j =
+          data->resident_begin() + uniform_index(rng.rng, resident);
+      if (resident < n_components ||
+          find(example_ids.begin(), example_ids.end(), j) == example_ids.end())
+        example_ids.push_back(j);
+    }
+    locs = arma::vectorise(data->slice_view(example_ids));
+  }
+  if (allreduce)
+    allreduce->sum(locs);
+  q->component_locs().set_loc(arma::reshape(locs, dimension, n_components));
+}
+
+void ConjugateInference::begin_pass() {
+  stats.zeros();
+  arma::vec alpha = q->mixture_weight().alpha();
+  double psi_sum = gsl_sf_psi(arma::accu(alpha));
+  arma::mat scale = q->component_locs().scale();
+  arma::vec inv_var = 1.0 / arma::square(p->get_likelihood().get_scale());
+  log_shift.set_size(n_components);
+  for (arma::uword k = 0; k < n_components; ++k)
+    log_shift(k) = gsl_sf_psi(alpha(k)) - psi_sum -
+                   0.5 * arma::dot(arma::square(scale.col(k)), inv_var);
+}
+
+void ConjugateInference::accumulate_block(const arma::mat &x, arma::vec &out) {
+  const arma::vec ones(n_components, arma::fill::ones);
+  arma::mat log_r = normal_mixture_log_joint(
+      x, q->component_locs().loc(), p->get_likelihood().get_scale(), ones);
+  log_r.each_row() += log_shift.t();
+
+  // normalized in place; log_norm ends as the log normalizer of each row
+  arma::vec log_norm = arma::max(log_r, 1);
+  log_r.each_col() -= log_norm;
+  arma::mat &r = log_r;
+  r = arma::exp(r);
+  arma::vec sum_r = arma::sum(r, 1);
+  r.each_col() /= sum_r;
+  log_norm += arma::log(sum_r);
+
+  out.head(n_components) += arma::sum(r, 0).t();
+  arma::mat s_k(out.memptr() + n_components, dimension, n_components, false,
+                true);
+  s_k += x * r;
+  out(out.n_elem - 1) += arma::accu(log_norm);
+}
+
+// Each thread sums a fixed range of blocks into its own partial, and the
+// partials are added in thread order: for a given n_threads the statistics
+// are the same in every run, so results are reproducible and resume exactly.
+void ConjugateInference::accumulate(arma::uword begin, arma::uword n) {
+  long long n_blocks = (n + block_size - 1) / block_size;
+  partials.resize(threads);
+  for (arma::vec &local : partials)
+    local.zeros(stats.n_elem);
+#pragma omp parallel num_threads(threads)
+  {
+    arma::vec &local = partials[omp_get_thread_num()];
+    ExampleIds example_ids;
+#pragma omp for schedule(static)
+    for (long long b = 0; b < n_blocks; ++b) {
+      example_ids.clear();
+      arma::uword end = min<arma::uword>(n, (b + 1) * block_size);
+      for (arma::uword j = b * block_size; j < end; ++j)
+        example_ids.push_back(begin + j);
+      accumulate_block(data->slice_view(example_ids), local);
+    }
+  }
+  for (const arma::vec &local : partials)
+    stats += local;
+}
+
+void ConjugateInference::update(double scale, double rho) {
+  const arma::vec &alpha0 = p->get_mixture_weight().get_alpha();
+  const PNormal &prior = p->get_component_locs();
+  const arma::vec inv_var0 = 1.0 / arma::square(prior.get_scale());
+  const arma::vec inv_var =
+      1.0 / arma::square(p->get_likelihood().get_scale());
+  const arma::vec n_k = scale * stats.head(n_components);
+  const arma::mat s_k =
+      scale * arma::mat(stats.memptr() + n_components, dimension,
+                        n_components);
+
+  // the optimum for the scaled statistics, in natural parameters
+  arma::vec alpha_opt = alpha0 + n_k;
+  arma::mat precision_opt = inv_var * n_k.t();
+  precision_opt.each_col() += inv_var0;
+  arma::mat eta_opt = s_k.each_col() % inv_var;
+  eta_opt.each_col() += prior.get_loc() % inv_var0;
+
+  QDirichlet &q_weight = q->mixture_weight();
+  q_weight.set_alpha((1 - rho) * q_weight.alpha() + rho * alpha_opt);
+
+  QNormal &q_locs = q->component_locs();
+  if (q_locs.learns_scale()) {
+    arma::mat precision = 1.0 / arma::square(q_locs.scale());
+    arma::mat eta = q_locs.loc() % precision;
+    precision = (1 - rho) * precision + rho * precision_opt;
+    eta = (1 - rho) * eta + rho * eta_opt;
+    q_locs.set_loc(eta / precision);
+    q_locs.set_scale(1.0 / arma::sqrt(precision));
+  } else {
+    // the scale stays fixed; the optimal mean does not depend on it
+    q_locs.set_loc((1 - rho) * q_locs.loc() + rho * eta_opt / precision_opt);
+  }
+}
+
+double ConjugateInference::kl_globals() {
+  const arma::vec &alpha0 = p->get_mixture_weight().get_alpha();
+  arma::vec alpha = q->mixture_weight().alpha();
+  double alpha_sum = arma::accu(alpha);
+  double psi_sum = gsl_sf_psi(alpha_sum);
+  double kl = gsl_sf_lngamma(alpha_sum) - gsl_sf_lngamma(arma::accu(alpha0));
+  for (arma::uword k = 0; k < n_components; ++k)
+    kl += gsl_sf_lngamma(alpha0(k)) - gsl_sf_lngamma(alpha(k)) +
+          (alpha(k) - alpha0(k)) * (gsl_sf_psi(alpha(k)) - psi_sum);
+
+  // per element: log(scale0 / scale) + (scale^2 + (loc - loc0)^2) /
+  // (2 scale0^2) - 1/2
+  const PNormal &prior = p->get_component_locs();
+  QNormal &q_locs = q->component_locs();
+  arma::mat scale = q_locs.scale();
+  arma::mat d = q_locs.loc().each_col() - prior.get_loc();
+  arma::mat var = arma::square(scale) + arma::square(d);
+  var.each_col() /= 2 * arma::square(prior.get_scale());
+  arma::mat log_ratio = -arma::log(scale);
+  log_ratio.each_col() += arma::log(prior.get_scale());
+  return kl + arma::accu(log_ratio + var - 0.5);
+}
+
+ConjugateInference::TrainStats ConjugateInference::step_cavi() {
+  Timer timer;
+  begin_pass();
+  // one pass over every chunk of this process's shard; the next pass starts
+  // on the next chunk
+  for (arma::uword seen = 0; seen < data->shard_size();) {
+    accumulate(data->resident_begin(), data->resident_size());
+    seen += data->resident_size();
+    if (!data->next_chunk() && seen < data->shard_size())
+      throw runtime_error("the chunks do not cover the shard");
+  }
+  if (allreduce)
+    allreduce->sum(stats);
+
+  TrainStats train_stats = {iteration, stats(stats.n_elem - 1) - kl_globals(),
+                            0};
+  update(1, 1);
+  train_stats.seconds = timer.lap();
+  ++iteration;
+  return train_stats;
+}
+
+ConjugateInference::TrainStats
+ConjugateInference::step_svi(const ExampleIds &example_ids) {
+  Timer timer;
+  begin_pass();
+  accumulate_block(data->slice_view(example_ids), stats);
+  if (allreduce)
+    allreduce->sum(stats);
+
+  double scale = (n_examples + 0.0) / example_ids.size() /
+                 (allreduce ? allreduce->size() : 1);
+  TrainStats train_stats = {
+      iteration, scale * stats(stats.n_elem - 1) - kl_globals(), 0};
+  update(scale, pow(iteration + delay, -kappa));
+  train_stats.seconds = timer.lap();
+  ++iteration;
+  return train_stats;
+}
+
+void ConjugateInference::print_stats(const TrainStats &stats) {
+  printf("Iteration %d, ELBO %.6e, %.3fs\n", stats.iteration, stats.elbo,
+         stats.seconds);
+}
+
+void ConjugateInference::train() {
+  auto n_iterations = options.get<int>("conjugate.n_iterations");
+  auto print_every = options.get<int>("conjugate.print_every", 1);
+  auto tol = options.get<double>("conjugate.tol", 0);
+  auto batch_size = options.get<int>("batch_size");
+  auto batch_order = options.get<string>("batch_order", "seq");
+  arma::uword batch_st = 0, n_drawn = 0;
+  int rank = allreduce ? allreduce->rank() : 0;
+
+  bool resumed = false;
+  shared_ptr<Checkpointer> checkpointer;
+  auto checkpoint_path = options.get<string>("checkpoint.path", "");
+  auto checkpoint_every = options.get<int>("checkpoint.every", 0);
+  if (!checkpoint_path.empty()) {
+    if (allreduce)
+      checkpoint_path += "." + to_string(rank);
+    checkpointer = make_shared<Checkpointer>(checkpoint_path);
+    TrainState state;
+    if (options.get<bool>("checkpoint.resume", true) &&
+        load_resume_state(*checkpointer, allreduce.get(), state)) {
+      restore_checkpoint(state, batch_st, n_drawn);
+      resumed = true;
+      if (rank == 0)
+        printf("Resumed from %s at iteration %d\n", checkpoint_path.c_str(),
+               iteration);
+    }
+  }
+
+  if (!resumed && options.get<bool>("conjugate.init_from_data", true))
+    init_locs();
+
+  double last_elbo = NAN;
+  while (iteration < n_iterations) {
+    TrainStats train_stats;
+    if (svi) {
+      // as in VariationalInference::train()
+      if (n_drawn >= data->resident_size()) {
+        if (data->next_chunk())
+          batch_st = 0;
+        n_drawn = 0;
+      }
+      rng_set_stream(batch_rng->rng, iteration, 0);
+      ExampleIds ex = gen_example_ids(batch_rng->rng, batch_order, batch_size,
+                                      data->resident_begin(),
+                                      data->resident_size(), &batch_st);
+      n_drawn += batch_size;
+      train_stats = step_svi(ex);
+    } else {
+      train_stats = step_cavi();
+    }
+    if (rank == 0 && train_stats.iteration % print_every == 0) {
+      print_stats(train_stats);
+      q->print();
+    }
+    if (checkpointer && checkpoint_every > 0 &&
+        iteration % checkpoint_every == 0)
+      save_checkpoint(*checkpointer, batch_st, n_drawn);
+    // the ELBO of a full pass only increases; minibatch ones are noisy
+    if (!svi && fabs(train_stats.elbo - last_elbo) <=
+                    tol * fabs(train_stats.elbo)) {
+      if (rank == 0)
+        printf("Converged after %d iterations\n", iteration);
+      break;
+    }
+    last_elbo = train_stats.elbo;
+  }
+  if (checkpointer) {
+    save_checkpoint(*checkpointer, batch_st, n_drawn);
+    checkpointer->wait();
+  }
+}
+
+// The format of VariationalInference: the optimizers hold the parameters,
+// and the minibatch rng is the only one.
+void ConjugateInference::save_checkpoint(Checkpointer &checkpointer,
+                                         arma::uword batch_st,
+                                         arma::uword n_drawn) {
+  TrainState &state = checkpointer.snapshot();
+  checkpoint_barrier(allreduce.get());
+  state.iteration = iteration;
+  state.batch_st = batch_st;
+  state.n_drawn = n_drawn;
+  state.resident_begin = data->resident_begin();
+
+  vector<Optimizer *> optimizers;
+  q->collect_optimizers(optimizers);
+  state.optimizers.resize(optimizers.size());
+  for (size_t k = 0; k < optimizers.size(); ++k)
+    optimizers[k]->save_state(state.optimizers[k]);
+
+  state.rngs.resize(1);
+  save_rng(batch_rng->rng, state.rngs[0]);
+  checkpointer.save();
+}
+
+void ConjugateInference::restore_checkpoint(const TrainState &state,
+                                            arma::uword &batch_st,
+                                            arma::uword &n_drawn) {
+  vector<Optimizer *> optimizers;
+  q->collect_optimizers(optimizers);
+  if (state.optimizers.size() != optimizers.size() || state.rngs.empty())
+    throw runtime_error("checkpoint does not match the model");
+  for (size_t k = 0; k < optimizers.size(); ++k)
+    optimizers[k]->load_state(state.optimizers[k]);
+  load_rng(batch_rng->rng, state.rngs[0]);
+
+  for (arma::uword c = 0; data->resident_begin() != state.resident_begin;
+       ++c)
+    if (!data->next_chunk() || c > data->n_examples())
+      throw runtime_error("checkpoint does not match the data");
+
+  iteration = state.iteration;
+  batch_st = state.batch_st;
+  n_drawn = state.n_drawn;
+}
@@ -0,0 +1,92 @@
+#pragma once
+
+#include "allreduce.hpp"
+#include "checkpoint.hpp"
+#include "data.hpp"
+#include "gaussian_mixture.hpp"
+#include "random.hpp"
+#include "utils.hpp"
+
+// Closed-form updates of the conditionally conjugate Gaussian mixture. Given
+// the responsibilities r_nk = q(c_n = k) of every example, the optimal q(pi)
+// is Dirichlet(alpha0 + N_k) and the optimal q(loc_k) is normal with
+// precision 1/scale0^2 + N_k/sigma^2 and mean (loc0/scale0^2 +
+// S_k/sigma^2) / precision, where N_k = sum_n r_nk and S_k = sum_n r_nk x_n.
+// The responsibilities follow from the current q in closed form too, so they
+// are recomputed block by block in every pass and never stored.
+//
+// engine=cavi alternates both updates on the full data (coordinate ascent);
+// engine=svi computes the global update from one minibatch, scaled up to the
+// data, and moves the natural parameters (alpha, and precision and
+// precision * mean) a step (t + delay)^-kappa towards it (stochastic natural
+// gradient). The results are written to the parameters of
+// QGaussianMixture through its optimizers, so print() and the checkpoint
+// format are the ones of VariationalInference.
+class ConjugateInference {
+public:
+  // data is read from data_file unless given
+  ConjugateInference(pt::ptree &options, PGaussianMixture *p,
+                     QGaussianMixture *q, shared_ptr<Data> data = NULL);
+
+  struct TrainStats {
+    int iteration;
+    // before the update, with optimal responsibilities; the data term is
+    // scaled up from the minibatch for svi
+    double elbo;
+    double seconds;
+  };
+
+  void print_stats(const TrainStats &stats);
+
+  // conjugate.n_iterations updates; cavi stops early once the ELBO changes
+  // by less than conjugate.tol relative to its magnitude
+  void train();
+
+  TrainStats step_cavi();
+  TrainStats step_svi(const ExampleIds &example_ids);
+
+private:
+  pt::ptree options;
+  PGaussianMixture *p;
+  QGaussianMixture *q;
+  shared_ptr<Data> data;
+  // NULL unless several processes train together
+  shared_ptr<AllReduce> allreduce;
+  shared_ptr<GSLRandom> batch_rng;
+  arma::uword n_examples, n_components, dimension;
+  int iteration, threads, block_size;
+  bool svi;
+  double kappa, delay;
+
+  // Sufficient statistics: N_k, then S_k column by column, then the sum of
+  // log sum_k exp(E[log pi_k] + E[log N(x_n | loc_k, sigma^2)]) over the
+  // examples, the ELBO terms of their optimal responsibilities.
+  arma::vec stats;
+  // the statistics summed by each thread in accumulate()
+  vector<arma::vec> partials;
+  // E[log pi_k] - sum_d scale_dk^2 / (2 sigma_d^2), shared by every
+  // example of a pass
+  arma::vec log_shift;
+
+  // q as constructed has identical components, which closed-form updates
+  // keep identical: the locations start at distinct random resident
+  // examples instead, the same on every process
+  void init_locs();
+
+  // zeroes the statistics and computes log_shift from the current q
+  void begin_pass();
+  // adds the statistics of the examples [begin, begin + n)
+  void accumulate(arma::uword begin, arma::uword n);
+  void accumulate_block(const arma::mat &x, arma::vec &out);
+
+  // moves q a step rho towards the optimum for statistics scaled by scale
+  void update(double scale, double rho);
+
+  // KL(q(pi) || p(pi)) + KL(q(loc) || p(loc))
+  double kl_globals();
+
+  void save_checkpoint(Checkpointer &checkpointer, arma::uword batch_st,
+                       arma::uword n_drawn);
+  void restore_checkpoint(const TrainState &state, arma::uword &batch_st,
+                          arma::uword &n_drawn);
+};
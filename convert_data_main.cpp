@@ -0,0 +1,16 @@
+#include "data.hpp"
+#include "utils.hpp"
+
+// Converts a text data file to the binary format that build_data maps into
+// memory.
+int main(int argc, char **argv) {
+  if (argc != 3) {
+    cerr << "usage: " << argv[0] << " <text data file> <binary data file>"
+         << endl;
+    return 1;
+  }
+  pt::ptree options;
+  DenseData data(options, argv[1]);
+  save_binary_data(*data.get_mat(), argv[2]);
+  return 0;
+}
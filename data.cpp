@@ -1,32 +1,311 @@
 #include "data.hpp"
 
+#include <cstring>
+#include <fcntl.h>
+#include <fstream>
+#include <new>
+#include <type_traits>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
 shared_ptr<Data> build_data(const string &data_type, const pt::ptree &options,
-                            const string &fname) {
-  if (data_type == "dense") {
-    return shared_ptr<Data>(new DenseData(options, fname));
+                            const string &fname, int rank, int size) {
+  if (data_type == "mmap" || (data_type == "dense" && is_binary_data(fname))) {
+    return shared_ptr<Data>(new MappedData(options, fname, rank, size));
+  } else if (data_type == "dense") {
+    return shared_ptr<Data>(new DenseData(options, fname, rank, size));
+  } else if (data_type == "stream") {
+    return shared_ptr<Data>(new StreamingData(options, fname, rank, size));
   } else {
     throw runtime_error("unknown data type");
   }
 }
 
-DenseData::DenseData(const pt::ptree &options, const string &fname) {
+const arma::mat &Data::slice_view(const ExampleIds &example_ids) {
+  static thread_local shared_ptr<arma::mat> batch;
+  batch = slice_data(example_ids);
+  return *batch;
+}
+
+// slice_view() of the columns of data, which hold examples [begin, begin +
+// data.n_cols). The header of a view is rebuilt in place when the range
+// moves, and a gather reuses its buffer, so neither allocates once warm.
+static const arma::mat &view_or_gather(arma::mat &data, arma::uword begin,
+                                       const ExampleIds &example_ids) {
+  static thread_local aligned_storage<sizeof(arma::mat),
+                                      alignof(arma::mat)>::type view_storage;
+  static thread_local arma::mat *view = NULL;
+  static thread_local arma::mat buffer;
+
+  bool in_range = true;
+  bool contiguous = !example_ids.empty();
+  for (size_t i = 0; i < example_ids.size(); ++i) {
+    in_range &=
+        example_ids[i] >= begin && example_ids[i] - begin < data.n_cols;
+    contiguous &= example_ids[i] == example_ids[0] + i;
+  }
+  if (!in_range)
+    throw runtime_error("example not in the resident data");
+
+  if (contiguous) {
+    double *mem = data.colptr(example_ids[0] - begin);
+    if (!view || view->memptr() != mem || view->n_rows != data.n_rows ||
+        view->n_cols != example_ids.size()) {
+      // a view does not own its memory, so nothing is freed here
+      if (view)
+        view->~Mat();
+      view = new (&view_storage)
+          arma::mat(mem, data.n_rows, example_ids.size(), false, true);
+    }
+    return *view;
+  }
+
+  buffer.set_size(data.n_rows, example_ids.size());
+  for (size_t i = 0; i < example_ids.size(); ++i)
+    buffer.col(i) = data.col(example_ids[i] - begin);
+  return buffer;
+}
+
+void shard_range(arma::uword n, int rank, int size, arma::uword *begin,
+                 arma::uword *end) {
+  *begin = n * rank / size;
+  *end = n * (rank + 1) / size;
+  if (*begin == *end)
+    throw runtime_error("fewer examples than processes");
+}
+
+bool is_binary_data(const string &fname) {
+  ifstream fin(fname, ios::binary);
+  char magic[sizeof(binary_data_magic)];
+  if (!fin.read(magic, sizeof(magic)))
+    return false;
+  return memcmp(magic, binary_data_magic, sizeof(magic)) == 0;
+}
+
+void save_binary_data(const arma::mat &data, const string &fname) {
+  BinaryDataHeader header;
+  memcpy(header.magic, binary_data_magic, sizeof(header.magic));
+  header.n_rows = data.n_rows;
+  header.n_cols = data.n_cols;
+  header.header_size = sizeof(BinaryDataHeader);
+
+  ofstream fout(fname, ios::binary);
+  fout.write(reinterpret_cast<const char *>(&header), sizeof(header));
+  fout.write(reinterpret_cast<const char *>(data.memptr()),
+             data.n_elem * sizeof(double));
+  if (!fout)
+    throw runtime_error("failed to write " + fname);
+}
+
+DenseData::DenseData(const pt::ptree &options, const string &fname, int rank,
+                     int size)
+    : options(options) {
   ifstream fin(fname);
-  arma::uword n_rows, n_cols;
-  fin >> n_rows >> n_cols;
-  arma::mat tmp_data(n_rows, n_cols);
+  if (!fin)
+    throw runtime_error("failed to open " + fname);
+  arma::uword n_rows, end;
+  fin >> n_rows >> n_total;
+  shard_range(n_total, rank, size, &begin, &end);
+  data.reset(new arma::mat(n_rows, end - begin));
   float datum;
   for (arma::uword i = 0; i < n_rows; ++i) {
-    for (arma::uword j = 0; j < n_cols; ++j) {
+    for (arma::uword j = 0; j < n_total; ++j) {
       fin >> datum;
-      tmp_data(i, j) = datum;
+      if (j >= begin && j < end)
+        (*data)(i, j - begin) = datum;
     }
   }
-  data = shared_ptr<arma::mat>(new arma::mat(tmp_data));
+}
+
+const arma::mat &DenseData::slice_view(const ExampleIds &example_ids) {
+  return view_or_gather(*data, begin, example_ids);
 }
 
 shared_ptr<Data> DenseData::transpose() const {
+  if (data->n_cols != n_total)
+    throw runtime_error("transpose() needs every example");
   DenseData *trans_data = new DenseData();
   trans_data->options = options;
   trans_data->data.reset(new arma::mat(data->t()));
+  trans_data->n_total = data->n_rows;
   return shared_ptr<Data>(trans_data);
 }
+
+MappedData::MappedData(const pt::ptree &options, const string &fname,
+                       int rank, int size) {
+  this->options = options;
+  int fd = open(fname.c_str(), O_RDONLY);
+  if (fd < 0)
+    throw runtime_error("failed to open " + fname);
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    close(fd);
+    throw runtime_error("failed to stat " + fname);
+  }
+  mapping_size = st.st_size;
+  mapping = mmap(NULL, mapping_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (mapping == MAP_FAILED)
+    throw runtime_error("failed to mmap " + fname);
+
+  const BinaryDataHeader *header =
+      static_cast<const BinaryDataHeader *>(mapping);
+  if (mapping_size < sizeof(BinaryDataHeader) ||
+      memcmp(header->magic, binary_data_magic, sizeof(header->magic)) != 0 ||
+      header->header_size % sizeof(double) != 0 ||
+      mapping_size < header->header_size +
+                         header->n_rows * header->n_cols * sizeof(double)) {
+    munmap(mapping, mapping_size);
+    throw runtime_error("not a valid binary data file: " + fname);
+  }
+
+  n_total = header->n_cols;
+  arma::uword end;
+  try {
+    shard_range(n_total, rank, size, &begin, &end);
+  } catch (...) {
+    munmap(mapping, mapping_size);
+    throw;
+  }
+  // the mapping is read-only; arma only needs a non-const pointer to alias it
+  double *mem = reinterpret_cast<double *>(static_cast<char *>(mapping) +
+                                           header->header_size) +
+                begin * header->n_rows;
+  data.reset(new arma::mat(mem, header->n_rows, end - begin, false, true));
+}
+
+MappedData::~MappedData() {
+  data.reset();
+  munmap(mapping, mapping_size);
+}
+
+StreamingData::StreamingData(const pt::ptree &options, const string &fname,
+                             int rank, int size)
+    : options(options), fname(fname), rank(rank), size(size), stopping(false),
+      failed(false) {
+  ifstream fin(fname, ios::binary | ios::ate);
+  arma::uword file_size = fin ? (arma::uword)fin.tellg() : 0;
+  fin.seekg(0);
+  BinaryDataHeader header;
+  // as in MappedData, and without examples there is no chunk to read
+  if (!fin.read(reinterpret_cast<char *>(&header), sizeof(header)) ||
+      memcmp(header.magic, binary_data_magic, sizeof(header.magic)) != 0 ||
+      header.header_size % sizeof(double) != 0 || header.n_rows == 0 ||
+      header.n_cols == 0 ||
+      file_size < header.header_size +
+                      header.n_rows * header.n_cols * sizeof(double))
+    throw runtime_error("not a valid binary data file: " + fname);
+  n_rows = header.n_rows;
+  n_cols = header.n_cols;
+  header_size = header.header_size;
+  chunk_size = min<arma::uword>(
+      options.get<arma::uword>("stream.chunk_size", 65536), n_cols);
+  prefetch = max<arma::uword>(options.get<arma::uword>("stream.prefetch", 2), 1);
+  n_chunks = (n_cols + chunk_size - 1) / chunk_size;
+  if (n_chunks < (arma::uword)size)
+    throw runtime_error("fewer chunks than processes, see stream.chunk_size");
+  n_shard = 0;
+  for (arma::uword c = rank; c < n_chunks; c += size)
+    n_shard += min(chunk_size, n_cols - c * chunk_size);
+
+  reader = thread(&StreamingData::read_chunks, this);
+  try {
+    next_chunk();
+  } catch (...) {
+    // the destructor does not run for a failed constructor
+    stop_reader();
+    throw;
+  }
+}
+
+StreamingData::~StreamingData() { stop_reader(); }
+
+void StreamingData::stop_reader() {
+  {
+    lock_guard<mutex> lock(queue_mutex);
+    stopping = true;
+  }
+  queue_cv.notify_all();
+  reader.join();
+}
+
+void StreamingData::read_chunks() {
+  ifstream fin(fname, ios::binary);
+  arma::uword c = rank;
+  while (true) {
+    arma::uword begin = c * chunk_size;
+    Chunk chunk;
+    chunk.begin = begin;
+    chunk.data.reset(new arma::mat(n_rows, min(chunk_size, n_cols - begin)));
+    fin.seekg(header_size + begin * n_rows * sizeof(double));
+    fin.read(reinterpret_cast<char *>(chunk.data->memptr()),
+             chunk.data->n_elem * sizeof(double));
+
+    vector<function<double(double)>> funcs;
+    {
+      lock_guard<mutex> lock(queue_mutex);
+      funcs = transforms;
+    }
+    for (const auto &func : funcs)
+      chunk.data->transform(func);
+    chunk.n_transforms = funcs.size();
+
+    {
+      unique_lock<mutex> lock(queue_mutex);
+      if (!fin) {
+        failed = true;
+        queue_cv.notify_all();
+        return;
+      }
+      queue_cv.wait(lock,
+                    [&]() { return stopping || queue.size() < prefetch; });
+      if (stopping)
+        return;
+      queue.push_back(chunk);
+    }
+    queue_cv.notify_all();
+
+    c += size;
+    if (c >= n_chunks)
+      c = rank;
+  }
+}
+
+bool StreamingData::next_chunk() {
+  unique_lock<mutex> lock(queue_mutex);
+  queue_cv.wait(lock, [&]() { return failed || !queue.empty(); });
+  if (queue.empty())
+    throw runtime_error("failed to read " + fname);
+  resident = queue.front();
+  queue.pop_front();
+  for (auto t = resident.n_transforms; t < transforms.size(); ++t)
+    resident.data->transform(transforms[t]);
+  resident.n_transforms = transforms.size();
+  lock.unlock();
+  queue_cv.notify_all();
+  return true;
+}
+
+shared_ptr<arma::mat>
+StreamingData::slice_data(const ExampleIds &example_ids) {
+  shared_ptr<arma::mat> batch(new arma::mat(n_rows, example_ids.size()));
+  for (size_t i = 0; i < example_ids.size(); ++i) {
+    auto j = example_ids[i] - resident.begin;
+    if (example_ids[i] < resident.begin || j >= resident.data->n_cols)
+      throw runtime_error("example not in the resident chunk");
+    batch->col(i) = resident.data->col(j);
+  }
+  return batch;
+}
+
+const arma::mat &StreamingData::slice_view(const ExampleIds &example_ids) {
+  return view_or_gather(*resident.data, resident.begin, example_ids);
+}
+
+void StreamingData::transform(function<double(double)> func) {
+  lock_guard<mutex> lock(queue_mutex);
+  transforms.push_back(func);
+  resident.data->transform(func);
+  resident.n_transforms = transforms.size();
+}
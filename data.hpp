@@ -1,10 +1,18 @@
 #pragma once
 
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <thread>
+
 #include "utils.hpp"
 
 // a general data base class
 class Data {
 public:
+  virtual ~Data() {}
+
   // sp_mat || mat
   virtual string get_data_type() = 0;
   virtual shared_ptr<arma::sp_mat> get_sp_mat() {
@@ -20,43 +28,166 @@ public:
   // training/testing split
   virtual shared_ptr<arma::mat> get_train_filter() { return NULL; }
 
-  virtual int n_examples() = 0;
+  virtual arma::uword n_examples() = 0;
   virtual int n_dim_y() = 0;
   virtual shared_ptr<Data> transpose() const = 0;
   virtual shared_ptr<arma::mat> slice_data(const ExampleIds &example_ids) = 0;
 
+  // Non-owning batch: a view of the data when the ids are a contiguous range,
+  // otherwise the columns gathered into a buffer owned by the calling thread.
+  // Valid until the next slice_view() on the same thread.
+  virtual const arma::mat &slice_view(const ExampleIds &example_ids);
+
+  // only examples [resident_begin(), resident_begin() + resident_size()) can
+  // be sliced; in-memory datasets keep all of their shard resident
+  virtual arma::uword resident_begin() { return 0; }
+  virtual arma::uword resident_size() { return n_examples(); }
+  // examples held by this process over all of its chunks; n_examples()
+  // counts those of every process
+  virtual arma::uword shard_size() { return resident_size(); }
+  // moves on to the next chunk of examples; returns false if the resident
+  // examples did not change
+  virtual bool next_chunk() { return false; }
+
   virtual void transform(function<double(double)> func) = 0;
 };
 
+// "dense" reads the text format, or memory-maps fname if it is a binary
+// data file; "mmap" requires a binary data file and "stream" reads one in
+// chunks. Process rank of size only holds its own shard: examples [n * rank
+// / size, n * (rank + 1) / size) in memory, or every size-th chunk from
+// chunk rank when streamed.
 shared_ptr<Data> build_data(const string &data_type, const pt::ptree &options,
-                            const string &fname);
+                            const string &fname, int rank = 0, int size = 1);
+
+// Binary data files hold this header followed by the [n_rows, n_cols] matrix
+// of doubles in column-major order, starting at header_size bytes.
+struct BinaryDataHeader {
+  char magic[8];
+  uint64_t n_rows;
+  uint64_t n_cols;
+  uint64_t header_size;
+};
+
+const char binary_data_magic[8] = {'G', 'M', 'M', 'D', 'A', 'T', 'A', '1'};
+
+bool is_binary_data(const string &fname);
+
+void save_binary_data(const arma::mat &data, const string &fname);
+
+// the shard [begin, end) of n examples held by process rank of size
+void shard_range(arma::uword n, int rank, int size, arma::uword *begin,
+                 arma::uword *end);
 
 class DenseData : public Data {
-private:
+protected:
   pt::ptree options;
+  // the examples [begin, begin + data->n_cols) of n_total
   shared_ptr<arma::mat> data;
+  arma::uword begin, n_total;
 
-  DenseData() {}
+  DenseData() : begin(0), n_total(0) {}
 
 public:
   string get_data_type() { return "mat"; }
   shared_ptr<arma::mat> get_mat() { return data; }
 
-  int n_examples() { return data->n_cols; }
+  arma::uword n_examples() { return n_total; }
 
   int n_dim_y() { return data->n_rows; }
 
   shared_ptr<Data> transpose() const;
 
-  DenseData(const pt::ptree &options, const string &fname);
+  // only the columns of the shard are kept, although every process parses
+  // the whole text
+  DenseData(const pt::ptree &options, const string &fname, int rank = 0,
+            int size = 1);
 
   shared_ptr<arma::mat> slice_data(const ExampleIds &example_ids) {
-    shared_ptr<arma::mat> batch(
-        new arma::mat(data->n_rows, example_ids.size()));
-    for (size_t i = 0; i < example_ids.size(); ++i)
-      batch->col(i) = data->col(example_ids[i]);
-    return batch;
+    return shared_ptr<arma::mat>(new arma::mat(slice_view(example_ids)));
   }
 
+  const arma::mat &slice_view(const ExampleIds &example_ids);
+
+  arma::uword resident_begin() { return begin; }
+  arma::uword resident_size() { return data->n_cols; }
+
   void transform(function<double(double)> func) { data->transform(func); }
 };
+
+// A binary data file mapped read-only into memory. The matrix aliases the
+// columns of the shard in the mapping, so loading is O(1), only the pages of
+// the shard are ever read and processes on a host share them.
+class MappedData : public DenseData {
+private:
+  void *mapping;
+  size_t mapping_size;
+
+public:
+  MappedData(const pt::ptree &options, const string &fname, int rank = 0,
+             int size = 1);
+  ~MappedData();
+
+  void transform(function<double(double)> func) {
+    throw runtime_error("transform() not supported on read-only MappedData");
+  }
+};
+
+// Streams a binary data file in chunks of stream.chunk_size examples. A
+// background thread reads ahead into a queue of at most stream.prefetch
+// chunks, so memory stays constant and disk reads overlap with training.
+// Process rank of size only reads chunks rank, rank + size, ..., in file
+// order, wrapping around at the end.
+class StreamingData : public Data {
+private:
+  struct Chunk {
+    arma::uword begin;
+    size_t n_transforms;
+    shared_ptr<arma::mat> data;
+  };
+
+  pt::ptree options;
+  string fname;
+  arma::uword n_rows, n_cols, header_size;
+  arma::uword chunk_size, prefetch;
+  int rank, size;
+  arma::uword n_chunks, n_shard;
+
+  Chunk resident;
+  deque<Chunk> queue;
+  vector<function<double(double)>> transforms;
+  bool stopping, failed;
+  mutex queue_mutex;
+  condition_variable queue_cv;
+  thread reader;
+
+  void read_chunks();
+  void stop_reader();
+
+public:
+  StreamingData(const pt::ptree &options, const string &fname, int rank = 0,
+                int size = 1);
+  ~StreamingData();
+
+  string get_data_type() { return "mat"; }
+
+  arma::uword n_examples() { return n_cols; }
+
+  int n_dim_y() { return n_rows; }
+
+  shared_ptr<Data> transpose() const {
+    throw runtime_error("transpose() not supported on StreamingData");
+  }
+
+  shared_ptr<arma::mat> slice_data(const ExampleIds &example_ids);
+
+  const arma::mat &slice_view(const ExampleIds &example_ids);
+
+  arma::uword resident_begin() { return resident.begin; }
+  arma::uword resident_size() { return resident.data->n_cols; }
+  arma::uword shard_size() { return n_shard; }
+  bool next_chunk();
+
+  // applies to the resident chunk and to every chunk read after it
+  void transform(function<double(double)> func);
+};
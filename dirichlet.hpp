@@ -8,6 +8,7 @@
 
 #include "link_function.hpp"
 #include "model.hpp"
+#include "random.hpp"
 #include "utils.hpp"
 
 class PDirichlet : public Model {
@@ -23,12 +24,16 @@ public:
     alpha = alpha * options.get<double>("p.init_alpha");
   }
 
-  double compute_log_p(arma::vec z) {
+  double compute_log_p(const arma::mat &z) {
     double *alpha_ = alpha.memptr();
-    double *z_ = z.memptr();
+    const double *z_ = z.memptr();
     size_t K = alpha.size();
     return gsl_ran_dirichlet_lnpdf(K, alpha_, z_);
   }
+
+  arma::mat grad_log_p(const arma::mat &z) { return (alpha - 1) / z; }
+
+  const arma::vec &get_alpha() const { return alpha; }
 };
 
 class QDirichlet : public Variational {
@@ -37,6 +42,39 @@ protected:
   size_t n_components;
   LinkFunction *lf;
 
+  // everything that depends on walpha only, recomputed once per update from
+  // a snapshot of walpha, which asynchronous workers update in place
+  struct Derived {
+    arma::vec alpha, lf_g;
+    // lf_g (psi(alpha) - psi(sum alpha)), the score at log z = 0
+    arma::vec shift;
+    // d H / d alpha, see grad_path()
+    arma::vec grad_entropy;
+    // log Gamma(sum alpha) - sum log Gamma(alpha)
+    double log_norm;
+  };
+  ParamCache<Derived> cache;
+
+  shared_ptr<const Derived> derived() {
+    return cache.get(param_version(0), [&](Derived &d) {
+      arma::mat w;
+      load_relaxed(walpha, w);
+      d.alpha = lf->f(w);
+      d.lf_g = lf->g(w);
+      double alpha_0 = arma::accu(d.alpha);
+      double psi_sum = gsl_sf_psi(alpha_0);
+      double shared = (alpha_0 - n_components) * gsl_sf_psi_1(alpha_0);
+      d.shift.set_size(n_components);
+      d.grad_entropy.set_size(n_components);
+      d.log_norm = gsl_sf_lngamma(alpha_0);
+      for (arma::uword i = 0; i < n_components; ++i) {
+        d.shift(i) = d.lf_g(i) * (gsl_sf_psi(d.alpha(i)) - psi_sum);
+        d.grad_entropy(i) = shared - (d.alpha(i) - 1) * gsl_sf_psi_1(d.alpha(i));
+        d.log_norm -= gsl_sf_lngamma(d.alpha(i));
+      }
+    });
+  }
+
 public:
   QDirichlet(){};
 
@@ -49,44 +87,103 @@ public:
       return val * lf->f_inv(options.get<double>("q.init_alpha"));
     });
     sample_shape = {walpha.n_rows};
-    ScoreFunctionGlobal score_alpha = [=](arma::vec z, arma::uword i) {
-      auto alpha = walpha.transform([&](double val) { return lf->f(val); });
-      auto lf_g = lf->g(alpha(i));
-      return lf_g *
-             (gsl_sf_psi(alpha(i)) - gsl_sf_psi(arma::accu(alpha)) + log(z(i)));
+    // d log q / d walpha_i = f'(walpha_i) (psi(alpha_i) - psi(sum alpha) +
+    // log z_i); everything but log z_i is shared by the draws
+    ScoreKernel score_alpha = [=](const arma::mat &z, arma::mat &score) {
+      auto d = derived();
+      score = arma::log(z);
+      score.each_col() %= d->lf_g;
+      score.each_col() += d->shift;
     };
-    register_param(&walpha, score_alpha, false);
+    register_param("alpha", &walpha, score_alpha, false);
+    init_layouts();
   }
 
   void print() {
-    cout << walpha.transform([&](double val) { return lf->f(val); }) << endl;
+    cout << alpha() << endl;
   };
 
   shared_ptr<arma::mat> sample(gsl_rng *rng) {
-    arma::vec walpha_col = walpha.col(0);
-    arma::vec alpha_col =
-        walpha_col.transform([&](double val) { return lf->f(val); });
-    double arr[n_components];
-    double *alpha_col_ = alpha_col.memptr();
-    gsl_ran_dirichlet(rng, n_components, alpha_col_, arr);
-    vector<double> std_vec(arr, arr + n_components);
-    // need to convert vector to mat of [n, 1] shape
-    shared_ptr<arma::mat> res(new arma::mat(n_components, 1));
-    *res = arma::conv_to<arma::mat>::from(std_vec);
-    return res;
+    shared_ptr<arma::mat> z(new arma::mat(alloc_sample()));
+    sample_into(rng, *z);
+    return z;
   }
 
-  double compute_log_q(arma::vec z) {
-    arma::vec wcol = walpha.col(0);
-    arma::vec col = wcol.transform([&](double val) { return lf->f(val); });
-    double *alpha_ = col.memptr();
+  void sample_into(gsl_rng *rng, arma::mat &z) {
+    auto d = derived();
+    // normalized gammas, drawn in one batch
+    fill_gamma(rng, d->alpha.memptr(), z.memptr(), n_components);
     double *z_ = z.memptr();
-    return gsl_ran_dirichlet_lnpdf(n_components, alpha_, z_);
+    double sum = 0;
+    for (arma::uword i = 0; i < n_components; ++i)
+      sum += z_[i];
+    for (arma::uword i = 0; i < n_components; ++i)
+      z_[i] /= sum;
   }
 
-  arma::vec alpha() {
-    return walpha.transform([&](double val) { return lf->f(val); });
-  };
+  // All S x K gammas of an iteration in one fill_gamma call, normalized per
+  // column in place.
+  bool batched() const { return true; }
+  void sample_draws_into(gsl_rng *rng, arma::mat &z, arma::mat *noise) {
+    // per-thread scratch for the shape of every draw
+    static thread_local arma::mat shape;
+    shape.set_size(n_components, z.n_cols);
+    shape.each_col() = derived()->alpha;
+    arma::mat &gammas = noise ? *noise : z;
+    fill_gamma(rng, shape.memptr(), gammas.memptr(), gammas.n_elem);
+    if (noise)
+      z = *noise;
+    z.each_row() /= arma::sum(z, 0);
+  }
+
+  // z = gamma / sum(gamma), with the gammas as noise
+  void sample_path_into(gsl_rng *rng, arma::mat &z, arma::mat &noise) {
+    auto d = derived();
+    fill_gamma(rng, d->alpha.memptr(), noise.memptr(), n_components);
+    z = noise / arma::accu(noise);
+  }
+
+  // Implicit reparameterization of the gammas, see gamma_grad_shape(),
+  // through dz_j / dgamma_i = (delta_ij - z_j) / sum(gamma). The entropy
+  // gradient is d H / d alpha_i = (alpha_0 - K) psi'(alpha_0) - (alpha_i - 1)
+  // psi'(alpha_i).
+  void grad_path(const arma::mat &z, const arma::mat &noise,
+                 const arma::mat &grad_z, double entropy_weight, Packed &grads,
+                 size_t first_slot) {
+    auto d = derived();
+    const arma::vec &alpha = d->alpha;
+    arma::vec grad(grads.memptr(first_slot, 0), n_components, false, true);
+    grad.zeros();
+    for (arma::uword s = 0; s < z.n_cols; ++s) {
+      double sum = arma::accu(noise.col(s));
+      double g_dot_z = arma::dot(grad_z.col(s), z.col(s));
+      for (arma::uword i = 0; i < n_components; ++i)
+        grad(i) += (grad_z(i, s) - g_dot_z) / sum *
+                   gamma_grad_shape(noise(i, s), alpha(i));
+    }
+    grad /= z.n_cols;
+    grad = d->lf_g % (grad + entropy_weight * d->grad_entropy);
+  }
+
+  // gsl_ran_dirichlet_lnpdf with the cached normalizer
+  double compute_log_q(const arma::mat &z) {
+    auto d = derived();
+    const double *z_ = z.memptr();
+    double log_q = d->log_norm;
+    for (arma::uword i = 0; i < n_components; ++i)
+      log_q += (d->alpha(i) - 1) * log(z_[i]);
+    return log_q;
+  }
+
+  arma::vec alpha() { return derived()->alpha; };
+
+  // walpha such that alpha() is alpha, e.g. a closed-form update
+  void set_alpha(const arma::vec &alpha) {
+    arma::mat w(arma::size(walpha));
+    for (arma::uword i = 0; i < n_components; ++i)
+      w(i) = lf->f_inv(alpha(i));
+    optimizers[0].assign(w);
+  }
 };
 
 #endif
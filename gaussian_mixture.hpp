@@ -12,45 +12,69 @@
 #include "normal.hpp"
 #include "utils.hpp"
 
+// All K component locations form one [D, K] latent, so the prior, the
+// likelihood and, on the variational side, sampling, log q and the scores of
+// every component are single matrix operations.
 class PGaussianMixture : public Model {
 private:
-  map<string, unique_ptr<Model>> distributions;
   size_t n_components;
+  unique_ptr<PDirichlet> mixture_weight;
+  // the same prior for every column of the locations
+  unique_ptr<PNormal> component_locs;
+  unique_ptr<PNormal> likelihood;
+
+  // slots of the variational latents, resolved once in bind()
+  size_t weight_slot, locs_slot;
 
 public:
   PGaussianMixture(const pt::ptree &options) : Model(options) {
     n_components = options.get<int>("p.n_components");
-    distributions["mixture_weight"].reset(new PDirichlet(options));
-    for (auto k = 0; k < n_components; k++) {
-      string component_name = "component_loc_" + to_string(k);
-      distributions[component_name].reset(
-          new PNormal(options, options.get<int>("data_dimension")));
-      distributions["likelihood"].reset(
-          new PNormal(options, options.get<int>("data_dimension")));
-    }
+    auto dimension = options.get<int>("data_dimension");
+    mixture_weight.reset(new PDirichlet(options));
+    component_locs.reset(new PNormal(options, dimension));
+    likelihood.reset(new PNormal(options, dimension));
   }
 
-  double compute_log_p(MapOfMat z) {
-    double res = 0;
-    res += distributions["mixture_weight"]->compute_log_p(*z["mixture_weight"]);
-    for (auto k = 0; k < n_components; k++) {
-      string component_name = "component_loc_" + to_string(k);
-      res += distributions[component_name]->compute_log_p(*z[component_name]);
-    }
-    return res;
+  // the conjugate parts, for closed-form updates
+  const PDirichlet &get_mixture_weight() const { return *mixture_weight; }
+  const PNormal &get_component_locs() const { return *component_locs; }
+  const PNormal &get_likelihood() const { return *likelihood; }
+
+  void bind(const Layout &latents) {
+    weight_slot = latents.slot("mixture_weight");
+    locs_slot = latents.slot("component_locs");
+  }
+
+  double compute_log_p(const Packed &z, arma::uword s) {
+    return mixture_weight->compute_log_p(z.block(weight_slot, s)) +
+           component_locs->compute_log_p(z.block(locs_slot, s));
   };
 
-  double compute_log_lik(arma::vec x, MapOfMat z) {
-    double res = 0;
-    for (auto k = 0; k < n_components; k++) {
-      string component_name = "component_loc_" + to_string(k);
-      auto loc = z[component_name];
-      auto component_weight = (*z["mixture_weight"])(k);
-      res += component_weight *
-             distributions["likelihood"]->compute_log_p(x, *loc);
-    }
-    return res;
+  arma::vec log_lik_matrix(const arma::mat &x, const Packed &z,
+                           arma::uword s) {
+    const arma::vec weights(const_cast<double *>(z.memptr(weight_slot, s)),
+                            n_components, false, true);
+    return likelihood->compute_log_lik(x, z.block(locs_slot, s), weights);
   };
+
+  void grad_log_joint(const arma::mat *x, const Packed &z, arma::uword s,
+                      double prior_weight, Packed &grad_z) {
+    arma::mat grad_weights = grad_z.block(weight_slot, s);
+    arma::mat grad_locs = grad_z.block(locs_slot, s);
+    grad_weights =
+        prior_weight * mixture_weight->grad_log_p(z.block(weight_slot, s));
+    grad_locs = prior_weight * component_locs->grad_log_p(z.block(locs_slot, s));
+    if (!x)
+      return;
+    const arma::vec weights(const_cast<double *>(z.memptr(weight_slot, s)),
+                            n_components, false, true);
+    arma::mat grad_loc_lik;
+    arma::vec grad_weights_lik;
+    likelihood->grad_log_lik(*x, z.block(locs_slot, s), weights, grad_loc_lik,
+                             grad_weights_lik);
+    grad_weights += grad_weights_lik;
+    grad_locs += grad_loc_lik;
+  }
 };
 
 class QGaussianMixture : public Variational {
@@ -60,42 +84,26 @@ protected:
 public:
   QGaussianMixture(const pt::ptree &options) : Variational(options) {
     n_components = options.get<int>("p.n_components");
-    distributions["mixture_weight"] =
-        unique_ptr<QDirichlet>(new QDirichlet(options));
-    for (auto k = 0; k < n_components; k++) {
-      string component_name = "component_loc_" + to_string(k);
-      distributions[component_name] = unique_ptr<QNormal>(
-          new QNormal(options, options.get<int>("data_dimension")));
-    }
+    add_distribution("mixture_weight", new QDirichlet(options));
+    // one [D, K] location and scale, with one optimizer each
+    add_distribution("component_locs",
+                     new QNormal(options, options.get<int>("data_dimension"),
+                                 n_components));
+  }
+
+  QDirichlet &mixture_weight() {
+    return static_cast<QDirichlet &>(*distributions[0]);
+  }
+  QNormal &component_locs() {
+    return static_cast<QNormal &>(*distributions[1]);
   }
 
   void print() {
-    for (const auto &p : distributions) {
-      cout << p.first << ": " << endl;
-      distributions[p.first]->print();
+    for (size_t k = 0; k < distributions.size(); ++k) {
+      cout << latent_layout[k].name << ": " << endl;
+      distributions[k]->print();
     }
   }
-
-  MapOfMat samples(gsl_rng *rng) {
-    MapOfMat z;
-    for (const auto &p : distributions)
-      z[p.first] = distributions[p.first]->sample(rng);
-    return z;
-  };
-
-  double compute_log_q(MapOfMat z) {
-    double res = 0;
-    for (const auto &p : distributions)
-      res += distributions[p.first]->compute_log_q(*z[p.first]);
-    return res;
-  };
-
-  MapOfMat grad_lq_matrix(MapOfMat z) {
-    MapOfMat res;
-    for (const auto &p : distributions)
-      res[p.first] = distributions[p.first]->grad_lq_matrix(z[p.first]);
-    return res;
-  };
 };
 
 #endif
@@ -1,3 +1,4 @@
+#include "conjugate_inference.hpp"
 #include "gaussian_mixture.hpp"
 #include "utils.hpp"
 #include "variational_inference.hpp"
@@ -7,7 +8,13 @@ int main() {
   pt::ini_parser::read_ini("options.ini", options);
   PGaussianMixture p_gaussian_mixture(options);
   QGaussianMixture q_gaussian_mixture(options);
-  VariationalInference vi(options, &p_gaussian_mixture, &q_gaussian_mixture);
-  vi.train();
+  // bbvi, or the closed-form cavi and svi of the conjugate model
+  if (options.get<string>("engine", "bbvi") == "bbvi") {
+    VariationalInference vi(options, &p_gaussian_mixture, &q_gaussian_mixture);
+    vi.train();
+  } else {
+    ConjugateInference ci(options, &p_gaussian_mixture, &q_gaussian_mixture);
+    ci.train();
+  }
   return 0;
 }
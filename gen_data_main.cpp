@@ -0,0 +1,123 @@
+#include "data.hpp"
+#include "random.hpp"
+#include "utils.hpp"
+
+#include <cstdio>
+#include <cstring>
+
+// Examples [c * x.n_cols, (c + 1) * x.n_cols) into x: components by inverse
+// CDF of the weights, then unit noise around them. Chunk c draws from stream
+// (c + 1, 0) of the seed, so every chunk can be generated on its own; the
+// counts of the components are added to counts unless NULL.
+static void gen_chunk(gsl_rng *rng, arma::uword c, const arma::vec &cdf,
+                      const arma::mat &loc, arma::mat &x, arma::uvec *counts) {
+  rng_set_stream(rng, c + 1, 0);
+  arma::vec u(x.n_cols);
+  fill_uniform(rng, u.memptr(), u.n_elem);
+  fill_normal(rng, x.memptr(), x.n_elem);
+  for (arma::uword j = 0; j < x.n_cols; ++j) {
+    arma::uword z = 0;
+    while (z + 1 < cdf.n_elem && u(j) > cdf(z))
+      ++z;
+    x.col(j) += loc.col(z);
+    if (counts)
+      ++(*counts)(z);
+  }
+}
+
+// Writes a synthetic Gaussian mixture dataset of n examples in d dimensions
+// drawn from k components: weights ~ Dirichlet(1), locations ~ N(0,
+// separation^2) and x ~ N(loc_z, 1). The data file is binary unless its
+// name ends in .dat; the ground truth goes to <data file>.truth.json. The
+// examples are generated and written in chunks of about 64 MB, so n is only
+// bounded by the disk. Text files are row-major, so every chunk is generated
+// again for each row; they are meant for small datasets.
+int main(int argc, char **argv) {
+  if (argc < 5 || argc > 7) {
+    cerr << "usage: " << argv[0]
+         << " <data file> <n> <d> <k> [seed] [separation]" << endl;
+    return 1;
+  }
+  string fname = argv[1];
+  arma::uword n = atol(argv[2]), d = atol(argv[3]), k = atol(argv[4]);
+  unsigned long seed = argc > 5 ? atol(argv[5]) : 1;
+  double separation = argc > 6 ? atof(argv[6]) : 10;
+
+  GSLRandom rng;
+  gsl_rng_set(rng.rng, seed);
+  arma::vec ones(k, arma::fill::ones), weights(k);
+  fill_gamma(rng.rng, ones.memptr(), weights.memptr(), k);
+  weights /= arma::accu(weights);
+  arma::mat loc(d, k);
+  fill_normal(rng.rng, loc.memptr(), loc.n_elem);
+  loc *= separation;
+
+  arma::vec cdf = arma::cumsum(weights);
+  // 8M doubles per chunk
+  arma::uword chunk_size =
+      max<arma::uword>(1, (8 << 20) / max<arma::uword>(d, 1));
+  arma::uword n_chunks = (n + chunk_size - 1) / chunk_size;
+  arma::uvec counts(k, arma::fill::zeros);
+  arma::mat x;
+
+  if (fname.size() > 4 && fname.substr(fname.size() - 4) == ".dat") {
+    FILE *f = fopen(fname.c_str(), "w");
+    if (!f)
+      throw runtime_error("failed to write " + fname);
+    fprintf(f, "%llu %llu\n", (unsigned long long)d, (unsigned long long)n);
+    for (arma::uword i = 0; i < d; ++i)
+      for (arma::uword c = 0; c < n_chunks; ++c) {
+        x.set_size(d, min(chunk_size, n - c * chunk_size));
+        gen_chunk(rng.rng, c, cdf, loc, x, i == 0 ? &counts : NULL);
+        bool last = c + 1 == n_chunks;
+        for (arma::uword j = 0; j < x.n_cols; ++j)
+          fprintf(f, last && j + 1 == x.n_cols ? "%.9g\n" : "%.9g ", x(i, j));
+      }
+    if (fclose(f) != 0)
+      throw runtime_error("failed to write " + fname);
+  } else {
+    BinaryDataHeader header;
+    memcpy(header.magic, binary_data_magic, sizeof(header.magic));
+    header.n_rows = d;
+    header.n_cols = 0;
+    header.header_size = sizeof(BinaryDataHeader);
+    FILE *f = fopen(fname.c_str(), "wb");
+    if (!f)
+      throw runtime_error("failed to write " + fname);
+    bool ok = fwrite(&header, sizeof(header), 1, f) == 1;
+    for (arma::uword c = 0; ok && c < n_chunks; ++c) {
+      x.set_size(d, min(chunk_size, n - c * chunk_size));
+      gen_chunk(rng.rng, c, cdf, loc, x, &counts);
+      ok = fwrite(x.memptr(), sizeof(double), x.n_elem, f) == x.n_elem;
+    }
+    // the header only announces the examples once all of them are written
+    header.n_cols = n;
+    ok = ok && fseek(f, 0, SEEK_SET) == 0 &&
+         fwrite(&header, sizeof(header), 1, f) == 1;
+    if (fclose(f) != 0 || !ok)
+      throw runtime_error("failed to write " + fname);
+  }
+
+  string truth = fname + ".truth.json";
+  FILE *f = fopen(truth.c_str(), "w");
+  if (!f)
+    throw runtime_error("failed to write " + truth);
+  fprintf(f, "{\"n\":%llu,\"d\":%llu,\"k\":%llu,\"seed\":%lu,\"weights\":[",
+          (unsigned long long)n, (unsigned long long)d, (unsigned long long)k,
+          seed);
+  for (arma::uword c = 0; c < k; ++c)
+    fprintf(f, c ? ",%.9g" : "%.9g", weights(c));
+  fprintf(f, "],\"locations\":[");
+  for (arma::uword c = 0; c < k; ++c) {
+    fprintf(f, c ? ",[" : "[");
+    for (arma::uword i = 0; i < d; ++i)
+      fprintf(f, i ? ",%.9g" : "%.9g", loc(i, c));
+    fprintf(f, "]");
+  }
+  fprintf(f, "],\"counts\":[");
+  for (arma::uword c = 0; c < k; ++c)
+    fprintf(f, c ? ",%llu" : "%llu", (unsigned long long)counts(c));
+  fprintf(f, "]}\n");
+  fclose(f);
+  return 0;
+}
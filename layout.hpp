@@ -0,0 +1,102 @@
+#pragma once
+
+#include <unordered_map>
+
+#include "utils.hpp"
+
+// A registry of named variables, resolved to integer slots once at
+// construction. Slot k is a [n_rows, n_cols] block starting at offset within
+// a flat buffer; names are only kept for printing and checkpoints.
+class Layout {
+public:
+  struct Slot {
+    string name;
+    arma::uword offset, n_rows, n_cols;
+
+    arma::uword n_elem() const { return n_rows * n_cols; }
+  };
+
+  Layout() : total(0) {}
+
+  size_t add(const string &name, arma::uword n_rows, arma::uword n_cols = 1) {
+    if (index.count(name) > 0)
+      throw runtime_error("duplicate slot " + name);
+    Slot slot = {name, total, n_rows, n_cols};
+    index[name] = slots.size();
+    slots.push_back(slot);
+    total += slot.n_elem();
+    return slots.size() - 1;
+  }
+
+  size_t slot(const string &name) const {
+    auto it = index.find(name);
+    if (it == index.end())
+      throw runtime_error("unknown slot " + name);
+    return it->second;
+  }
+
+  const Slot &operator[](size_t k) const { return slots[k]; }
+
+  size_t size() const { return slots.size(); }
+
+  arma::uword n_elem() const { return total; }
+
+private:
+  vector<Slot> slots;
+  unordered_map<string, size_t> index;
+  arma::uword total;
+};
+
+// Values of every slot of a Layout for n_draws draws (e.g. Monte Carlo
+// samples) in one contiguous buffer. All draws of slot k form a contiguous
+// [n_elem(k), n_draws] block, so both one draw of a slot and every draw of
+// it are plain views.
+class Packed {
+public:
+  Packed() : layout(NULL), n_draws_(0) {}
+
+  Packed(const Layout &layout, arma::uword n_draws)
+      : layout(&layout), n_draws_(n_draws),
+        buffer(layout.n_elem() * n_draws, arma::fill::zeros) {}
+
+  double *memptr(size_t k, arma::uword s) {
+    const Layout::Slot &slot = (*layout)[k];
+    return buffer.memptr() + slot.offset * n_draws_ + s * slot.n_elem();
+  }
+
+  const double *memptr(size_t k, arma::uword s) const {
+    return const_cast<Packed *>(this)->memptr(k, s);
+  }
+
+  // [n_rows, n_cols] view of draw s of slot k
+  arma::mat block(size_t k, arma::uword s) {
+    const Layout::Slot &slot = (*layout)[k];
+    return arma::mat(memptr(k, s), slot.n_rows, slot.n_cols, false, true);
+  }
+
+  const arma::mat block(size_t k, arma::uword s) const {
+    return const_cast<Packed *>(this)->block(k, s);
+  }
+
+  // [n_elem, n_draws] view of every draw of slot k
+  arma::mat draws(size_t k) {
+    return arma::mat(memptr(k, 0), (*layout)[k].n_elem(), n_draws_, false,
+                     true);
+  }
+
+  const arma::mat draws(size_t k) const {
+    return const_cast<Packed *>(this)->draws(k);
+  }
+
+  // the whole buffer, e.g. to reduce it across processes
+  arma::vec &values() { return buffer; }
+
+  const Layout &get_layout() const { return *layout; }
+
+  arma::uword n_draws() const { return n_draws_; }
+
+private:
+  const Layout *layout;
+  arma::uword n_draws_;
+  arma::vec buffer;
+};
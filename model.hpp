@@ -1,10 +1,14 @@
 #ifndef MODELS_HPP
 #define MODELS_HPP
 
+#include <cassert>
+#include <cstdint>
 #include <gsl/gsl_rng.h>
 
 #include "bbvi.hpp"
+#include "layout.hpp"
 #include "optimizer.hpp"
+#include "param_cache.hpp"
 #include "utils.hpp"
 
 class Model {
@@ -14,13 +18,64 @@ protected:
 public:
   Model() {}
   Model(const pt::ptree &options) : options(options) {}
-  virtual double compute_log_p(arma::vec z){};
+  virtual double compute_log_p(const arma::mat &z){};
   virtual double compute_log_p(arma::vec, arma::mat){};
-  virtual double compute_log_p(MapOfMat z){};
   virtual double compute_log_lik(shared_ptr<arma::mat> x,
                                  shared_ptr<arma::mat> z){};
-  // global variables
-  virtual double compute_log_lik(shared_ptr<arma::mat> x, MapOfMat z){};
+
+  // local variables: log-likelihood of every column of x given the matching
+  // column of z
+  virtual arma::rowvec log_lik_matrix(const arma::mat &x, const arma::mat &z) {
+    throw runtime_error("local log_lik_matrix() not implemented in Model");
+  }
+
+  // Resolves the slots of the variational latents this model reads; called
+  // once before training. A single-variable model reads slot 0.
+  virtual void bind(const Layout &latents) {}
+
+  // global variables, draw s of the packed latents
+  virtual double compute_log_p(const Packed &z, arma::uword s) {
+    return compute_log_p(z.block(0, s));
+  }
+
+  // batched likelihood of the columns of x [D, B] under a mixture with
+  // component locations given by the columns of loc [D, K]; returns [B]
+  virtual arma::vec compute_log_lik(const arma::mat &x, const arma::mat &loc,
+                                    const arma::vec &weights) {
+    throw runtime_error("batched compute_log_lik() not implemented in Model");
+  }
+
+  // per-example log-likelihood of a minibatch given the global variables
+  virtual arma::vec log_lik_matrix(const arma::mat &x, const Packed &z,
+                                   arma::uword s) {
+    throw runtime_error("log_lik_matrix() not implemented in Model");
+  }
+
+  // Pathwise gradients, see Variational::sample_path_into(). d log p / dz of
+  // a single-variable model.
+  virtual arma::mat grad_log_p(const arma::mat &z) {
+    throw runtime_error("grad_log_p() not implemented in Model");
+  }
+
+  // gradients of the batched likelihood, summed over the columns of x, with
+  // respect to the component locations loc [D, K] and the weights [K]
+  virtual void grad_log_lik(const arma::mat &x, const arma::mat &loc,
+                            const arma::vec &weights, arma::mat &grad_loc,
+                            arma::vec &grad_weights) {
+    throw runtime_error("grad_log_lik() not implemented in Model");
+  }
+
+  // global variables: d/dz of prior_weight log p(z) + log p(x | z) at draw s
+  // of the packed latents, into draw s of grad_z; x is NULL without
+  // observations
+  virtual void grad_log_joint(const arma::mat *x, const Packed &z,
+                              arma::uword s, double prior_weight,
+                              Packed &grad_z) {
+    if (x)
+      throw runtime_error("grad_log_joint() not implemented in Model");
+    arma::mat g = grad_z.block(0, s);
+    g = prior_weight * grad_log_p(z.block(0, s));
+  }
 
   shared_ptr<arma::mat> log_p_matrix(shared_ptr<arma::mat> z) {
     shared_ptr<arma::rowvec> log_p(new arma::rowvec(z->n_cols));
@@ -29,36 +84,137 @@ public:
     }
     return log_p;
   }
-
-  shared_ptr<arma::mat> log_p_matrix(MapOfMat z) {
-    shared_ptr<arma::mat> log_p(new arma::mat(1, 1));
-    (*log_p)(0, 0) = compute_log_p(z);
-    return log_p;
-  }
 };
 
 class Variational {
 protected:
   const pt::ptree options;
-  map<string, unique_ptr<Variational>> distributions;
+  // children of a hierarchical q, one latent slot each; the score slots of
+  // child k start at first_score_slot[k]
+  vector<unique_ptr<Variational>> distributions;
+  vector<size_t> first_score_slot;
+
+  // leaves call this once sample_shape is set: one latent slot
+  void init_layouts() {
+    latent_layout.add("z", alloc_sample().n_rows, alloc_sample().n_cols);
+  }
+
+  void add_distribution(const string &name, Variational *q) {
+    assert(q->latent_layout.size() == 1);
+    distributions.emplace_back(q);
+    latent_layout.add(name, q->latent_layout[0].n_rows,
+                      q->latent_layout[0].n_cols);
+    first_score_slot.push_back(score_layout.size());
+    for (size_t k = 0; k < q->score_layout.size(); ++k)
+      score_layout.add(name + "." + q->score_layout[k].name,
+                       q->score_layout[k].n_rows, q->score_layout[k].n_cols);
+  }
 
 public:
   Variational() {}
   Variational(const pt::ptree &options) : options(options) {}
-  typedef function<double(arma::vec, arma::uword, arma::uword)> ScoreFunction;
-  typedef function<double(arma::vec, arma::uword)> ScoreFunctionGlobal;
-  vector<ScoreFunction> score_funcs;
-  vector<ScoreFunctionGlobal> score_funcs_global;
+  // Score of one parameter for a batch of draws of a global latent: z holds
+  // one draw per column, [n_elem, S], and score has one column per draw.
+  // Parameter terms shared by all draws are computed once per call.
+  typedef function<void(const arma::mat &, arma::mat &)> ScoreKernel;
+  // Score of one local parameter for one draw of a minibatch: column b of z
+  // and of score belongs to example example_ids[b].
+  typedef function<void(const arma::mat &, const ExampleIds &, arma::mat &)>
+      LocalScoreKernel;
+  vector<ScoreKernel> score_kernels;
+  vector<LocalScoreKernel> local_score_kernels;
   vector<Serializable<arma::mat> *> param_matrices;
   vector<arma::uword> sample_shape;
   vector<Optimizer> optimizers;
+  // slots of samples_into(), and of grad_lq() with one slot per parameter
+  Layout latent_layout;
+  Layout score_layout;
+  // number of updates applied by asynchronous workers; a worker's staleness
+  // is how many other updates landed between its read and its write
+  uint64_t n_updates = 0;
+
+  // version of parameter k, see Optimizer::version(); a parameter without
+  // an optimizer never changes
+  uint64_t param_version(size_t k) const {
+    return k < optimizers.size() ? optimizers[k].version() : 0;
+  }
+
+  // the optimizers of this q and of its children, in a fixed order
+  void collect_optimizers(vector<Optimizer *> &out) {
+    for (auto &optimizer : optimizers)
+      out.push_back(&optimizer);
+    for (auto &q : distributions)
+      q->collect_optimizers(out);
+  }
+
+  // lets several workers update the parameters at once, see
+  // Optimizer::set_shared()
+  void share_params() {
+    for (auto &optimizer : optimizers)
+      optimizer.set_shared(true);
+    for (auto &q : distributions)
+      q->share_params();
+  }
 
   virtual arma::mat sample(gsl_rng *rng, arma::uword j){};
   virtual shared_ptr<arma::mat> sample(gsl_rng *rng){};
-  virtual MapOfMat samples(gsl_rng *rng){};
-  virtual double sample(gsl_rng *rng, arma::uword i, arma::uword j){};
   virtual void print(){};
 
+  // In-place sampling into a buffer shaped by sample_shape: [n_rows] or
+  // [n_rows, n_cols].
+  virtual void sample_into(gsl_rng *rng, arma::mat &z) { z = *sample(rng); }
+
+  arma::mat alloc_sample() const {
+    return arma::mat(sample_shape[0],
+                     sample_shape.size() > 1 ? sample_shape[1] : 1,
+                     arma::fill::zeros);
+  }
+
+  // draw s of the packed latents, laid out by latent_layout; with
+  // skip_batched, the leaves that sample in batches are left to
+  // samples_batch_into()
+  virtual void samples_into(gsl_rng *rng, Packed &z, arma::uword s,
+                            bool skip_batched = false) {
+    if (distributions.empty() && !(skip_batched && batched())) {
+      arma::mat z_s = z.block(0, s);
+      sample_into(rng, z_s);
+    }
+    for (size_t k = 0; k < distributions.size(); ++k) {
+      if (skip_batched && distributions[k]->batched())
+        continue;
+      arma::mat z_k = z.block(k, s);
+      distributions[k]->sample_into(rng, z_k);
+    }
+  }
+
+  // Leaves that can draw every sample of an iteration at once, one per
+  // column of z [n_elem, S], override these. noise is NULL unless the draws
+  // are reparameterized, see sample_path_into().
+  virtual bool batched() const { return false; }
+  virtual void sample_draws_into(gsl_rng *rng, arma::mat &z, arma::mat *noise) {
+    throw runtime_error("sample_draws_into() not implemented in Variational");
+  }
+
+  // all draws of the batched leaves, one leaf after the other from one rng
+  void samples_batch_into(gsl_rng *rng, Packed &z, Packed *noise) {
+    if (distributions.empty()) {
+      if (batched()) {
+        arma::mat z_d = z.draws(0);
+        arma::mat noise_d = noise ? noise->draws(0) : arma::mat();
+        sample_draws_into(rng, z_d, noise ? &noise_d : NULL);
+      }
+      return;
+    }
+    for (size_t k = 0; k < distributions.size(); ++k) {
+      if (!distributions[k]->batched())
+        continue;
+      arma::mat z_k = z.draws(k);
+      arma::mat noise_k = noise ? noise->draws(k) : arma::mat();
+      distributions[k]->sample_draws_into(rng, z_k, noise ? &noise_k : NULL);
+    }
+  }
+  virtual double sample(gsl_rng *rng, arma::uword i, arma::uword j){};
+
   shared_ptr<arma::mat> sample_matrix(gsl_rng *rng,
                                       const ExampleIds &example_ids) {
     auto n_rows = param_matrices[0]->n_rows;
@@ -79,97 +235,209 @@ public:
   }
 
   virtual double compute_log_q(arma::vec z, arma::uword i){};
-  virtual double compute_log_q(arma::vec z){};
-  virtual double compute_log_q(MapOfMat){};
+  virtual double compute_log_q(const arma::mat &z){};
+
+  virtual double compute_log_q(const Packed &z, arma::uword s) {
+    if (distributions.empty())
+      return compute_log_q(z.block(0, s));
+    double res = 0;
+    for (size_t k = 0; k < distributions.size(); ++k)
+      res += distributions[k]->compute_log_q(z.block(k, s));
+    return res;
+  }
+
+  // Reparameterization: draws z as a differentiable function of the
+  // parameters and of noise that does not depend on them, and keeps the
+  // noise for grad_path().
+  virtual void sample_path_into(gsl_rng *rng, arma::mat &z, arma::mat &noise) {
+    throw runtime_error("sample_path_into() not implemented in Variational");
+  }
+
+  // Mean pathwise gradient of every parameter over the draws; z, noise and
+  // grad_z = df/dz hold one draw per column, [n_elem, S]. The analytic
+  // entropy gradient, times entropy_weight, is added. Parameter k goes to
+  // slot first_slot + k of grads.
+  virtual void grad_path(const arma::mat &z, const arma::mat &noise,
+                         const arma::mat &grad_z, double entropy_weight,
+                         Packed &grads, size_t first_slot) {
+    throw runtime_error("grad_path() not implemented in Variational");
+  }
+
+  // draw s of the packed latents and of their noise, skip_batched as in
+  // samples_into()
+  void samples_path_into(gsl_rng *rng, Packed &z, Packed &noise,
+                         arma::uword s, bool skip_batched = false) {
+    if (distributions.empty() && !(skip_batched && batched())) {
+      arma::mat z_s = z.block(0, s), noise_s = noise.block(0, s);
+      sample_path_into(rng, z_s, noise_s);
+    }
+    for (size_t k = 0; k < distributions.size(); ++k) {
+      if (skip_batched && distributions[k]->batched())
+        continue;
+      arma::mat z_k = z.block(k, s), noise_k = noise.block(k, s);
+      distributions[k]->sample_path_into(rng, z_k, noise_k);
+    }
+  }
+
+  // global latent variables: pathwise gradients of every parameter, packed
+  // like the scores, from the packed df/dz of every draw
+  void estimate_grad_path(const Packed &z, const Packed &noise,
+                          const Packed &grad_z, double entropy_weight,
+                          Packed &grads, int threads) {
+    if (distributions.empty()) {
+      grad_path(z.draws(0), noise.draws(0), grad_z.draws(0), entropy_weight,
+                grads, 0);
+      return;
+    }
+#pragma omp parallel for num_threads(threads) schedule(dynamic)
+    for (size_t k = 0; k < distributions.size(); ++k)
+      distributions[k]->grad_path(z.draws(k), noise.draws(k), grad_z.draws(k),
+                                  entropy_weight, grads, first_score_slot[k]);
+  }
+
+  void register_param(const string &name, Serializable<arma::mat> *param_mat,
+                      ScoreKernel score_kernel, bool deserialize) {
+    if (!deserialize) {
+      optimizers.emplace_back(options, param_mat);
+      param_matrices.push_back(param_mat);
+    }
+    score_kernels.push_back(score_kernel);
+    score_layout.add(name, param_mat->n_rows, param_mat->n_cols);
+  }
 
-  void register_param(Serializable<arma::mat> *param_mat,
-                      ScoreFunctionGlobal score_func, bool deserialize) {
+  // a parameter with one column per example, updated only on the columns of
+  // each minibatch
+  void register_local_param(Serializable<arma::mat> *param_mat,
+                            LocalScoreKernel score_kernel, bool deserialize) {
     if (!deserialize) {
       optimizers.emplace_back(options, param_mat);
       param_matrices.push_back(param_mat);
     }
-    score_funcs_global.push_back(score_func);
+    local_score_kernels.push_back(score_kernel);
   }
 
+  bool is_local() const { return !local_score_kernels.empty(); }
+
   shared_ptr<arma::mat> log_q_matrix(shared_ptr<arma::mat> z,
                                      const ExampleIds &example_ids) {
     shared_ptr<arma::mat> log_q(new arma::mat(z->n_cols, 1));
     arma::uword ind = 0;
     for (auto j : example_ids) {
-      (*log_q)(ind, 1) = compute_log_q((*z).col(ind), j);
+      (*log_q)(ind, 0) = compute_log_q((*z).col(ind), j);
       ++ind;
     }
     return log_q;
   }
 
-  shared_ptr<arma::mat> log_q_matrix(MapOfMat z) {
-    shared_ptr<arma::mat> log_q(new arma::mat(1, 1));
-    (*log_q)(0, 0) = compute_log_q(z);
-    return log_q;
+  // local latent variables: scores of every parameter for draw s, z [rows,
+  // B], of the minibatch; column s of score[k] holds the [rows, B] scores
+  // of parameter k
+  void grad_lq_local(const arma::mat &z, const ExampleIds &example_ids,
+                     vector<arma::mat> &score, arma::uword s) {
+    for (size_t k = 0; k < local_score_kernels.size(); ++k) {
+      arma::mat score_k(score[k].colptr(s), z.n_rows, z.n_cols, false, true);
+      local_score_kernels[k](z, example_ids, score_k);
+    }
   }
 
-  /* shared_ptr<arma::cube> grad_lq_matrix(shared_ptr<arma::mat> z, */
-  /*                                       const ExampleIds &example_ids) { */
-  /*   size_t n_params = param_matrices.size(); */
-  /*   shared_ptr<arma::cube> grad_lp( */
-  /*       new arma::cube(z->n_rows, z->n_cols, n_params)); */
-  /*   arma::uword ind = 0; */
-  /*   for (auto j : example_ids) { */
-  /*     for (arma::uword i = 0; i < z->n_rows; ++i) { */
-  /*       for (size_t k = 0; k < score_funcs.size(); ++k) { */
-  /*         (*grad_lp)(i, ind, k) = score_funcs[k]((*z).col(ind), i, j); */
-  /*       } */
-  /*     } */
-  /*     ++ind; */
-  /*   } */
-  /*   return grad_lp; */
-  /* } */
-
-  // only global latent variables, no per-datapoint latents.
-  shared_ptr<arma::mat> grad_lq_matrix(shared_ptr<arma::mat> z) {
-    size_t n_params = param_matrices.size();
-    shared_ptr<arma::mat> grad_lq(new arma::mat(z->n_rows, n_params));
-    for (arma::uword i = 0; i < z->n_rows; ++i) {
-      for (size_t k = 0; k < score_funcs.size(); ++k) {
-        (*grad_lq)(i, k) = score_funcs_global[k]((*z).col(0), i);
-      }
+  // only global latent variables, no per-datapoint latents. z holds all
+  // draws [n_elem, S]; the scores of parameter k go to slot first_slot + k.
+  void grad_lq_batch(const arma::mat &z, Packed &score, size_t first_slot) {
+    for (size_t k = 0; k < score_kernels.size(); ++k) {
+      arma::mat score_k = score.draws(first_slot + k);
+      score_kernels[k](z, score_k);
+    }
+  }
+
+  // packed scores of all draws at once, laid out by score_layout
+  virtual void grad_lq(const Packed &z, Packed &score, int threads) {
+    if (distributions.empty()) {
+      grad_lq_batch(z.draws(0), score, 0);
+      return;
     }
-    return grad_lq;
+#pragma omp parallel for num_threads(threads) schedule(dynamic)
+    for (size_t k = 0; k < distributions.size(); ++k)
+      distributions[k]->grad_lq_batch(z.draws(k), score, first_score_slot[k]);
   }
 
-  // local latent variable model
-  BBVIStats update(const VecOfMat &score_q, const VecOfMat &log_p,
-                   const VecOfMat &log_q) {
+  // one gradient per registered parameter, estimated from that parameter's
+  // slot first_slot + k of the packed scores only, into the same slot of
+  // grads (score_layout, one draw)
+  BBVIStats estimate_grad(const Packed &score_q, size_t first_slot,
+                          const arma::mat &log_p, const arma::mat &log_q,
+                          Packed &grads, int threads) {
     BBVIStats stats;
     auto n_params = param_matrices.size();
     for (arma::uword k = 0; k < n_params; ++k) {
-      // This is inefficent just pass and index to bbvi
       BBVIStats stats_k;
-      auto grad_k =
-          grad_bbvi_factorized(options, score_q, log_p, log_q, stats_k,
-                               options.get<int>("n_threads"));
+      arma::vec grad(grads.memptr(first_slot + k, 0),
+                     param_matrices[k]->n_elem, false, true);
+      grad_bbvi_factorized(options, score_q.draws(first_slot + k), log_p,
+                           log_q, grad, stats_k, threads);
       stats += stats_k;
-      optimizers[k].update(*grad_k);
     }
     stats /= (n_params + 0.0);
     return stats;
   }
 
-  // hierarchical model; needs a map of score functions and optimizers
-  BBVIStats update(const MapVecOfMat &score_q, const VecOfMat &log_p,
-                   const VecOfMat &log_q) {
+  void apply_grad_at(const Packed &grads, size_t first_slot) {
+    for (size_t k = 0; k < optimizers.size(); ++k)
+      optimizers[k].update(grads.block(first_slot + k, 0));
+  }
+
+  // local latent variables: one gradient per parameter, over the minibatch
+  // columns only; log_p and log_q are [B, S]. Only those columns of the
+  // parameters and of the optimizer state are touched.
+  BBVIStats update_local(const vector<arma::mat> &score_q,
+                         const ExampleIds &example_ids, const arma::mat &log_p,
+                         const arma::mat &log_q, int threads) {
     BBVIStats stats;
-    for (const auto &element : score_q) {
-      auto name = element.first;
-      auto score = element.second;
-      auto stats_ = distributions[name]->update(score, log_p, log_q);
-      stats += stats_;
+    auto n_params = param_matrices.size();
+    arma::vec grad;
+    for (arma::uword k = 0; k < n_params; ++k) {
+      BBVIStats stats_k;
+      grad_bbvi_factorized(options, score_q[k], log_p, log_q, grad, stats_k,
+                           threads);
+      stats += stats_k;
+      optimizers[k].update(arma::mat(grad.memptr(), param_matrices[k]->n_rows,
+                                     example_ids.size(), false, true),
+                           example_ids);
     }
+    stats /= (n_params + 0.0);
+    return stats;
+  }
+
+  // Global latent variables: the gradients of every parameter, packed like
+  // the scores. A hierarchical q estimates every child from its slot of the
+  // packed scores; with enough children the children are estimated in
+  // parallel, otherwise each gradient is. Gradients are applied separately so
+  // that they can be combined across processes first.
+  BBVIStats estimate_grad(const Packed &score_q, const arma::mat &log_p,
+                          const arma::mat &log_q, Packed &grads, int threads) {
+    if (distributions.empty())
+      return estimate_grad(score_q, 0, log_p, log_q, grads, threads);
+    vector<BBVIStats> stats_k(distributions.size());
+    bool per_child = distributions.size() >= (size_t)threads;
+#pragma omp parallel for num_threads(threads) schedule(dynamic) if (per_child)
+    for (size_t k = 0; k < distributions.size(); ++k)
+      stats_k[k] = distributions[k]->estimate_grad(
+          score_q, first_score_slot[k], log_p, log_q, grads,
+          per_child ? 1 : threads);
+    BBVIStats stats;
+    for (const auto &s : stats_k)
+      stats += s;
     return stats;
   }
 
-  // global latent variables for a hierarchical model
-  virtual MapOfMat grad_lq_matrix(MapOfMat){};
+  void apply_grad(const Packed &grads, int threads) {
+    if (distributions.empty()) {
+      apply_grad_at(grads, 0);
+      return;
+    }
+#pragma omp parallel for num_threads(threads) schedule(dynamic)
+    for (size_t k = 0; k < distributions.size(); ++k)
+      distributions[k]->apply_grad_at(grads, first_score_slot[k]);
+  }
 
   friend class Optimizer;
   friend class VariationalInference;
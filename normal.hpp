@@ -8,19 +8,73 @@
 
 #include "link_function.hpp"
 #include "model.hpp"
+#include "random.hpp"
 #include "utils.hpp"
 
-double normal_log_prob(arma::vec z, arma::vec loc, arma::vec scale) {
-  z -= loc;
-  auto sigma2 = scale * scale;
-  return arma::accu(0.5 * log(2 * arma::datum::pi * sigma2) -
-                    z * z / (2 * sigma2));
+inline double normal_log_prob(const arma::mat &z, const arma::mat &loc,
+                              const arma::mat &scale) {
+  return arma::accu(-0.5 * arma::log(2 * arma::datum::pi * arma::square(scale)) -
+                    arma::square(z - loc) / (2 * arma::square(scale)));
+}
+
+// log w_k + log N(x_b | loc_k, diag(scale^2)) for every column x_b of x
+// [D, B] and every column loc_k of loc [D, K], as [B, K]. The squared
+// distances come from a single [B, K] product.
+inline arma::mat normal_mixture_log_joint(const arma::mat &x,
+                                          const arma::mat &loc,
+                                          const arma::vec &scale,
+                                          const arma::vec &weights) {
+  arma::vec inv_scale = 1.0 / scale;
+  arma::mat xs = x.each_col() % inv_scale;
+  arma::mat ls = loc.each_col() % inv_scale;
+
+  // ||x_b - loc_k||^2 = ||x_b||^2 - 2 x_b' loc_k + ||loc_k||^2
+  arma::mat log_joint = -2.0 * xs.t() * ls;
+  log_joint.each_col() += arma::sum(arma::square(xs), 0).t();
+  log_joint.each_row() += arma::sum(arma::square(ls), 0);
+  log_joint *= -0.5;
+  log_joint.each_row() += arma::log(weights).t();
+  log_joint += -0.5 * x.n_rows * log(2 * arma::datum::pi) -
+               arma::accu(arma::log(scale));
+  return log_joint;
+}
+
+// log sum_k w_k N(x_b | loc_k, diag(scale^2)), a log-sum-exp over the
+// components, for every column x_b of x [D, B]
+inline arma::vec normal_mixture_log_lik(const arma::mat &x, const arma::mat &loc,
+                                        const arma::vec &scale,
+                                        const arma::vec &weights) {
+  arma::mat log_lik = normal_mixture_log_joint(x, loc, scale, weights);
+  arma::vec max_lik = arma::max(log_lik, 1);
+  log_lik.each_col() -= max_lik;
+  return max_lik + arma::log(arma::sum(arma::exp(log_lik), 1));
+}
+
+// Gradients of the summed normal_mixture_log_lik through the
+// responsibilities r [B, K]: d/dloc_k = sum_b r_bk (x_b - loc_k) / scale^2
+// and d/dw_k = sum_b r_bk / w_k.
+inline void normal_mixture_grad_log_lik(const arma::mat &x,
+                                        const arma::mat &loc,
+                                        const arma::vec &scale,
+                                        const arma::vec &weights,
+                                        arma::mat &grad_loc,
+                                        arma::vec &grad_weights) {
+  arma::mat r = normal_mixture_log_joint(x, loc, scale, weights);
+  r.each_col() -= arma::max(r, 1);
+  r = arma::exp(r);
+  r.each_col() /= arma::sum(r, 1);
+  arma::rowvec n_k = arma::sum(r, 0);
+  grad_loc = x * r - loc.each_row() % n_k;
+  grad_loc.each_col() /= arma::square(scale);
+  grad_weights = n_k.t() / weights;
 }
 
 class PNormal : public Model {
 private:
   arma::vec loc;
   arma::vec scale;
+  // scale of an observation around its local mean
+  double obs_scale;
 
 public:
   using Model::Model; // inherit base constructors
@@ -29,43 +83,234 @@ public:
     loc = arma::vec(dimension, arma::fill::zeros);
     scale = arma::vec(dimension, arma::fill::zeros);
     scale.fill(options.get<double>("p.init_scale"));
+    obs_scale = options.get<double>("p.obs_scale", 1.0);
+  }
+  // every column of z [dimension, n] has this prior
+  double compute_log_p(const arma::mat &z) {
+    if (z.n_cols == 1)
+      return normal_log_prob(z, loc, scale);
+    arma::mat d = z.each_col() - loc;
+    d.each_col() /= scale;
+    return -0.5 * arma::accu(arma::square(d)) -
+           z.n_cols * arma::accu(arma::log(scale)) -
+           0.5 * z.n_elem * log(2 * arma::datum::pi);
+  }
+  arma::vec compute_log_lik(const arma::mat &x, const arma::mat &loc,
+                            const arma::vec &weights) {
+    return normal_mixture_log_lik(x, loc, scale, weights);
+  }
+  arma::mat grad_log_p(const arma::mat &z) {
+    arma::mat g = z.each_col() - loc;
+    g.each_col() %= -1.0 / arma::square(scale);
+    return g;
+  }
+  void grad_log_lik(const arma::mat &x, const arma::mat &loc,
+                    const arma::vec &weights, arma::mat &grad_loc,
+                    arma::vec &grad_weights) {
+    normal_mixture_grad_log_lik(x, loc, scale, weights, grad_loc,
+                                grad_weights);
   }
-  double compute_log_p(arma::vec z) { return normal_log_prob(z, loc, scale); }
-  double compute_log_p(arma::vec z, arma::vec loc) {
-    return normal_log_prob(z, loc, scale);
+  // x_b ~ N(z_b, obs_scale^2), for every column b
+  arma::rowvec log_lik_matrix(const arma::mat &x, const arma::mat &z) {
+    return -0.5 * x.n_rows * log(2 * arma::datum::pi * obs_scale * obs_scale) -
+           arma::sum(arma::square(x - z), 0) / (2 * obs_scale * obs_scale);
   }
+
+  const arma::vec &get_loc() const { return loc; }
+  const arma::vec &get_scale() const { return scale; }
 };
 
 class QNormal : public Variational {
 protected:
   Serializable<arma::mat> wloc;
+  // the scale is lf->f(wscale)
   Serializable<arma::mat> wscale;
+  LinkFunction *lf;
+  bool learn_scale;
+
+  // A snapshot of the parameters and what depends on them, vectorised and
+  // recomputed once per update of either; wscale is parameter 1 if it is
+  // learned and never moves otherwise. Sampling and scores read loc here
+  // rather than wloc, which asynchronous workers update in place.
+  struct Derived {
+    arma::vec loc, sigma, inv_var, lf_g;
+    // -sum log sigma - n/2 log 2 pi
+    double log_norm;
+  };
+  ParamCache<Derived> cache;
+
+  shared_ptr<const Derived> derived() {
+    // versions only grow, so their sum changes whenever one does
+    return cache.get(param_version(0) + param_version(1), [&](Derived &d) {
+      arma::mat w;
+      load_relaxed(wloc, w);
+      d.loc = arma::vectorise(w);
+      load_relaxed(wscale, w);
+      d.sigma = arma::vectorise(link_f(w));
+      d.inv_var = 1.0 / arma::square(d.sigma);
+      d.lf_g = arma::vectorise(link_g(w));
+      d.log_norm = -arma::accu(arma::log(d.sigma)) -
+                   0.5 * d.sigma.n_elem * log(2 * arma::datum::pi);
+    });
+  }
 
 public:
   using Variational::Variational;
-  QNormal(const pt::ptree &options, arma::uword dimension)
+  // A [dimension, n_cols] global latent, or, if local, one [dimension] latent
+  // per example: column j of the parameters belongs to example j and only the
+  // columns of a minibatch are sampled and updated.
+  QNormal(const pt::ptree &options, arma::uword dimension,
+          arma::uword n_cols = 1, bool local = false)
       : Variational(options) {
     /* this->options = options; */
-    wloc = arma::mat(dimension, 1);
+    lf = get_link_function(options.get<string>("q.link_function"));
+    wloc = arma::mat(dimension, n_cols);
     wloc.fill(0.01);
-    wscale = arma::mat(dimension, 1);
-    wscale.fill(options.get<double>("q.init_scale"));
-    ScoreFunctionGlobal score_loc = [=](arma::vec z, arma::uword i) {
-      return (z(i) - wloc(i)) / (wscale(i) * wscale(i));
+    wscale = arma::mat(dimension, n_cols);
+    wscale.fill(lf->f_inv(options.get<double>("q.init_scale")));
+    learn_scale = options.get<bool>("q.learn_scale", false);
+    if (local) {
+      sample_shape = {dimension};
+      register_local_param(&wloc, score_loc_local(), false);
+      if (learn_scale)
+        register_local_param(&wscale, score_scale_local(), false);
+    } else {
+      sample_shape = {dimension, n_cols};
+      ScoreKernel score_loc = [=](const arma::mat &z, arma::mat &score) {
+        auto d = derived();
+        score = z.each_col() - d->loc;
+        score.each_col() %= d->inv_var;
+      };
+      register_param("loc", &wloc, score_loc, false);
+      if (learn_scale) {
+        // d log q / d wscale = f'(wscale) ((z - loc)^2 / scale^3 - 1 / scale)
+        ScoreKernel score_scale = [=](const arma::mat &z, arma::mat &score) {
+          auto d = derived();
+          score = arma::square(z.each_col() - d->loc);
+          score.each_col() %= d->inv_var;
+          score -= 1.0;
+          score.each_col() %= d->lf_g / d->sigma;
+        };
+        register_param("scale", &wscale, score_scale, false);
+      }
+    }
+    init_layouts();
+  }
+
+  // the same scores on the minibatch columns only
+  LocalScoreKernel score_loc_local() {
+    return [=](const arma::mat &z, const ExampleIds &example_ids,
+               arma::mat &score) {
+      const arma::uvec cols = arma::conv_to<arma::uvec>::from(example_ids);
+      score = (z - wloc.cols(cols)) / arma::square(link_f(wscale.cols(cols)));
     };
-    register_param(&wloc, score_loc, false);
   }
 
-  void print() { cout << wloc << endl; }
+  LocalScoreKernel score_scale_local() {
+    return [=](const arma::mat &z, const ExampleIds &example_ids,
+               arma::mat &score) {
+      const arma::uvec cols = arma::conv_to<arma::uvec>::from(example_ids);
+      const arma::mat ws = wscale.cols(cols);
+      const arma::mat sigma = link_f(ws);
+      score = (arma::square(z - wloc.cols(cols)) / arma::pow(sigma, 3) -
+               1.0 / sigma) %
+              link_g(ws);
+    };
+  }
+
+  // lf->f and lf->g over a whole array
+  arma::mat link_f(const arma::mat &w) const { return lf->f(w); }
+
+  arma::mat link_g(const arma::mat &w) const { return lf->g(w); }
+
+  arma::mat scale() {
+    return arma::reshape(derived()->sigma, wscale.n_rows, wscale.n_cols);
+  }
+
+  const arma::mat &loc() const { return wloc; }
+
+  bool learns_scale() const { return learn_scale; }
+
+  // set outright, e.g. to a closed-form update; the scale only if it is
+  // learned
+  void set_loc(const arma::mat &loc) { optimizers[0].assign(loc); }
+
+  void set_scale(const arma::mat &scale) {
+    if (!learn_scale)
+      throw runtime_error("set_scale() needs q.learn_scale");
+    arma::mat w(arma::size(wscale));
+    for (arma::uword i = 0; i < w.n_elem; ++i)
+      w(i) = lf->f_inv(scale(i));
+    optimizers[1].assign(w);
+  }
+
+  void print() {
+    // local parameters: the first examples only
+    arma::mat loc;
+    load_relaxed(wloc, loc);
+    cout << loc.cols(0, min<arma::uword>(loc.n_cols, 10) - 1) << endl;
+  }
 
   shared_ptr<arma::mat> sample(gsl_rng *rng) {
-    shared_ptr<arma::mat> z(new arma::mat(wloc.n_cols, 1, arma::fill::zeros));
-    for (auto i = 0; i < wloc.n_cols; i++)
-      (*z)(i, 0) = gsl_ran_gaussian(rng, wscale(i)) + wloc(i);
+    shared_ptr<arma::mat> z(new arma::mat(alloc_sample()));
+    sample_into(rng, *z);
+    return z;
+  }
+
+  // standard normals in one batch, then scaled and shifted
+  void sample_into(gsl_rng *rng, arma::mat &z) {
+    sample_path_into(rng, z, z);
+  }
+
+  // z = loc + scale eps, with the standard normals eps as noise; z may
+  // alias noise
+  void sample_path_into(gsl_rng *rng, arma::mat &z, arma::mat &noise) {
+    auto d = derived();
+    fill_normal(rng, noise.memptr(), wloc.n_elem);
+    const double *eps = noise.memptr(), *loc = d->loc.memptr(),
+                 *scale = d->sigma.memptr();
+    double *z_ = z.memptr();
+    for (arma::uword i = 0; i < wloc.n_elem; i++)
+      z_[i] = eps[i] * scale[i] + loc[i];
+  }
+
+  // d/dloc = E[df/dz]; d/dwscale = f'(wscale) (E[df/dz eps] + entropy_weight
+  // / scale), the entropy being sum log scale + const
+  void grad_path(const arma::mat &z, const arma::mat &noise,
+                 const arma::mat &grad_z, double entropy_weight, Packed &grads,
+                 size_t first_slot) {
+    arma::vec grad_loc(grads.memptr(first_slot, 0), wloc.n_elem, false, true);
+    grad_loc = arma::mean(grad_z, 1);
+    if (!learn_scale)
+      return;
+    arma::vec grad_scale(grads.memptr(first_slot + 1, 0), wscale.n_elem,
+                         false, true);
+    auto d = derived();
+    grad_scale = arma::mean(grad_z % noise, 1) + entropy_weight / d->sigma;
+    grad_scale %= d->lf_g;
+  }
+
+  // local: the latent of example j
+  arma::mat sample(gsl_rng *rng, arma::uword j) {
+    arma::mat z(wloc.n_rows, 1);
+    for (arma::uword i = 0; i < wloc.n_rows; i++)
+      z(i) = sample(rng, i, j);
     return z;
   }
 
-  double compute_log_q(arma::vec z) { return normal_log_prob(z, wloc, wscale); }
+  double sample(gsl_rng *rng, arma::uword i, arma::uword j) {
+    return gsl_ran_gaussian(rng, lf->f(wscale(i, j))) + wloc(i, j);
+  }
+
+  double compute_log_q(arma::vec z, arma::uword j) {
+    return normal_log_prob(z, wloc.col(j), link_f(wscale.col(j)));
+  }
+
+  double compute_log_q(const arma::mat &z) {
+    auto d = derived();
+    const arma::vec r = arma::vectorise(z) - d->loc;
+    return d->log_norm - 0.5 * arma::dot(arma::square(r), d->inv_var);
+  }
 };
 
 #endif
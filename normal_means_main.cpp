@@ -0,0 +1,17 @@
+#include "normal.hpp"
+#include "utils.hpp"
+#include "variational_inference.hpp"
+
+// Normal means: one local latent mean per example, x_j ~ N(z_j, obs_scale^2)
+// with z_j ~ N(0, p.init_scale^2).
+int main() {
+  pt::ptree options;
+  pt::ini_parser::read_ini("options.ini", options);
+  auto data = build_data(options.get<string>("data_type", "dense"), options,
+                         options.get<string>("data_file"));
+  PNormal p_normal(options, data->n_dim_y());
+  QNormal q_normal(options, data->n_dim_y(), data->n_examples(), true);
+  VariationalInference vi(options, &p_normal, &q_normal, data);
+  vi.train();
+  return 0;
+}
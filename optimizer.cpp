@@ -1,64 +1,149 @@
 #include "optimizer.hpp"
 
-void Optimizer::ada_ascent(const arma::mat &g, const ExampleIds &example_ids) {
-  arma::uword j0 = 0;
-  for (auto j : example_ids) {
-    G.col(j) += g.col(j0) % g.col(j0);
-    ++j0;
+#include <cassert>
+
+void AdaGrad::apply(const double *__restrict__ g, double *__restrict__ G,
+                    double *__restrict__ V, double *__restrict__ Tau,
+                    double *__restrict__ w, arma::uword n, double rho,
+                    double tau) {
+  for (arma::uword i = 0; i < n; ++i) {
+    double G1 = G[i] + g[i] * g[i];
+    G[i] = G1;
+    w[i] += G1 > 0 ? rho / sqrt(G1) * g[i] : 0.0;
   }
+}
 
-  j0 = 0;
-  for (auto j : example_ids) {
-    for (arma::uword i = 0; i < G.n_rows; ++i) {
-      if (G(i, j) > 0)
-        (*w)(i, j) += rho / sqrt(G(i, j)) * g(i, j0);
-    }
-    ++j0;
+void RMSProp::apply(const double *__restrict__ g, double *__restrict__ G,
+                    double *__restrict__ V, double *__restrict__ Tau,
+                    double *__restrict__ w, arma::uword n, double rho,
+                    double tau) {
+  const double inv_tau = 1.0 / tau;
+  for (arma::uword i = 0; i < n; ++i) {
+    double g2 = g[i] * g[i];
+    double G1 = G[i] == 0 ? g2 : (1.0 - inv_tau) * G[i] + inv_tau * g2;
+    G[i] = G1;
+    w[i] += G1 > 0 ? rho / sqrt(G1) * g[i] : 0.0;
   }
 }
 
-void Optimizer::rmsprop_ascent(const arma::mat &g,
-                               const ExampleIds &example_ids) {
-  auto inv_tau = 1.0 / tau;
-  arma::uword j0 = 0;
-  for (auto j : example_ids) {
-    for (arma::uword i = 0; i < G.n_rows; ++i) {
-      auto G0 = G(i, j);
-      if (G0 == 0)
-        G(i, j) = g(i, j0) * g(i, j0);
-      else
-        G(i, j) = (1.0 - inv_tau) * G0 + inv_tau * g(i, j0) * g(i, j0);
+// G decays geometrically; a zero G stays zero, as in apply()
+void RMSProp::catch_up(double *G, double *V, double *Tau, arma::uword n,
+                       arma::uword missed, double tau) {
+  const double decay = pow(1.0 - 1.0 / tau, missed);
+  for (arma::uword i = 0; i < n; ++i)
+    G[i] *= decay;
+}
+
+void VSGD::apply(const double *__restrict__ g, double *__restrict__ G,
+                 double *__restrict__ V, double *__restrict__ Tau,
+                 double *__restrict__ w, arma::uword n, double rho,
+                 double tau) {
+  for (arma::uword i = 0; i < n; ++i) {
+    double inv_tau = 1.0 / Tau[i];
+    // update G & V
+    bool first = G[i] == 0;
+    double G1 = first ? g[i] * g[i]
+                      : (1.0 - inv_tau) * G[i] + inv_tau * g[i] * g[i];
+    double V1 = first ? g[i] : (1.0 - inv_tau) * V[i] + inv_tau * g[i];
+    G[i] = G1;
+    V[i] = V1;
+
+    // update w and Tau
+    bool positive = G1 > 0;
+    w[i] += positive ? rho * fabs(V1) / G1 * g[i] : 0.0;
+    Tau[i] = positive ? max((1.0 - V1 * V1 / G1) * Tau[i] + 1.0, 3.0) : Tau[i];
+  }
+}
 
-      if (G(i, j) > 0)
-        (*w)(i, j) += rho / sqrt(G(i, j)) * g(i, j0);
+// The first steps are taken exactly. After that the ratio c = V^2 / G * Tau
+// is nearly constant, so Tau grows by d = 1 - c per step and G, V decay by
+// prod_i (1 - 1 / (Tau + i d)) ~ ((Tau - 1) / (Tau + m d - 1))^(1 / d).
+void VSGD::catch_up(double *G, double *V, double *Tau, arma::uword n,
+                    arma::uword missed, double tau) {
+  const arma::uword exact_steps = 32;
+  for (arma::uword i = 0; i < n; ++i) {
+    if (G[i] == 0)
+      continue;
+    arma::uword m = missed;
+    for (; m > 0 && missed - m < exact_steps; --m) {
+      double inv_tau = 1.0 / Tau[i];
+      G[i] *= 1.0 - inv_tau;
+      V[i] *= 1.0 - inv_tau;
+      Tau[i] = max((1.0 - V[i] * V[i] / G[i]) * Tau[i] + 1.0, 3.0);
     }
-    ++j0;
+    if (m == 0)
+      continue;
+    double d = 1.0 - V[i] * V[i] / G[i] * Tau[i];
+    double decay;
+    if (d <= 0) {
+      // Tau does not grow
+      decay = pow(1.0 - 1.0 / Tau[i], m);
+    } else {
+      decay = pow((Tau[i] - 1.0) / (Tau[i] + m * d - 1.0), 1.0 / d);
+      Tau[i] += m * d;
+    }
+    G[i] *= decay;
+    V[i] *= decay;
   }
 }
 
-void Optimizer::vsgd_ascent(const arma::mat &g, const ExampleIds &example_ids) {
+template <class Rule>
+void Optimizer::ascent(const arma::mat &g, const ExampleIds &example_ids) {
+  ++n_steps;
   arma::uword j0 = 0;
   for (auto j : example_ids) {
-    for (arma::uword i = 0; i < G.n_rows; ++i) {
-      auto G0 = G(i, j);
-      auto V0 = V(i, j);
-      auto inv_tau = 1.0 / Tau(i, j);
-      // update G & V
-      if (G0 == 0) {
-        G(i, j) = g(i, j0) * g(i, j0);
-        V(i, j) = g(i, j0);
-      } else {
-        G(i, j) = (1.0 - inv_tau) * G0 + inv_tau * g(i, j0) * g(i, j0);
-        V(i, j) = (1.0 - inv_tau) * V0 + inv_tau * g(i, j0);
-      }
-
-      // update w and Tau
-      if (G(i, j) > 0) {
-        (*w)(i, j) += rho * abs(V(i, j)) / G(i, j) * g(i, j0);
-        Tau(i, j) =
-            max((1.0 - V(i, j) * V(i, j) / G(i, j)) * Tau(i, j) + 1.0, 3.0);
-      }
-    }
+    // steps since column j was last in a minibatch, with a zero gradient
+    arma::uword missed = last_step[j] < n_steps ? n_steps - 1 - last_step[j] : 0;
+    if (missed > 0)
+      Rule::catch_up(G.colptr(j), V.colptr(j), Tau.colptr(j), G.n_rows, missed,
+                     tau);
+    last_step[j] = n_steps;
+    Rule::apply(g.colptr(j0), G.colptr(j), V.colptr(j), Tau.colptr(j),
+                w->colptr(j), G.n_rows, rho, tau);
     ++j0;
   }
 }
+
+template <class Rule> void Optimizer::ascent_dense(const arma::mat &g) {
+  assert(g.n_elem == w->n_elem);
+  Rule::apply(g.memptr(), G.memptr(), V.memptr(), Tau.memptr(), w->memptr(),
+              G.n_elem, rho, tau);
+}
+
+// The elements are loaded into a thread-local block with relaxed atomic
+// loads, stepped by the usual vectorized rule, and stored back with relaxed
+// atomic stores.
+template <class Rule> void Optimizer::ascent_shared(const arma::mat &g) {
+  assert(g.n_elem == w->n_elem);
+  const arma::uword block = 256;
+  double bG[block], bV[block], bTau[block], bw[block];
+  double *state[4] = {G.memptr(), V.memptr(), Tau.memptr(), w->memptr()};
+  double *local[4] = {bG, bV, bTau, bw};
+  for (arma::uword b = 0; b < g.n_elem; b += block) {
+    arma::uword n = min(block, g.n_elem - b);
+    for (int k = 0; k < 4; ++k)
+      for (arma::uword i = 0; i < n; ++i)
+        __atomic_load(state[k] + b + i, local[k] + i, __ATOMIC_RELAXED);
+    Rule::apply(g.memptr() + b, bG, bV, bTau, bw, n, rho, tau);
+    for (int k = 0; k < 4; ++k)
+      for (arma::uword i = 0; i < n; ++i)
+        __atomic_store(state[k] + b + i, local[k] + i, __ATOMIC_RELAXED);
+  }
+}
+
+void Optimizer::setup() {
+  if (algo == "adagrad") {
+    step = &Optimizer::ascent<AdaGrad>;
+    dense_step = shared ? &Optimizer::ascent_shared<AdaGrad>
+                        : &Optimizer::ascent_dense<AdaGrad>;
+  } else if (algo == "rmsprop") {
+    step = &Optimizer::ascent<RMSProp>;
+    dense_step = shared ? &Optimizer::ascent_shared<RMSProp>
+                        : &Optimizer::ascent_dense<RMSProp>;
+  } else if (algo == "vsgd") {
+    step = &Optimizer::ascent<VSGD>;
+    dense_step = shared ? &Optimizer::ascent_shared<VSGD>
+                        : &Optimizer::ascent_dense<VSGD>;
+  } else
+    throw runtime_error("unknown optimization algorithm");
+}
@@ -3,13 +3,74 @@
 #include "utils.hpp"
 #include <signal.h>
 
+// Update rules. apply() makes one fused pass over n contiguous elements of
+// the gradient g, the optimizer state G, V, Tau and the parameters w; the
+// steps are branch-free so that the loop vectorizes.
+// catch_up() applies, in place of `missed` steps with a zero gradient, their
+// effect on the state of n elements; w does not move on a zero gradient.
+struct AdaGrad {
+  static void apply(const double *__restrict__ g, double *__restrict__ G,
+                    double *__restrict__ V, double *__restrict__ Tau,
+                    double *__restrict__ w, arma::uword n, double rho,
+                    double tau);
+  static void catch_up(double *G, double *V, double *Tau, arma::uword n,
+                       arma::uword missed, double tau) {}
+};
+
+struct RMSProp {
+  static void apply(const double *__restrict__ g, double *__restrict__ G,
+                    double *__restrict__ V, double *__restrict__ Tau,
+                    double *__restrict__ w, arma::uword n, double rho,
+                    double tau);
+  static void catch_up(double *G, double *V, double *Tau, arma::uword n,
+                       arma::uword missed, double tau);
+};
+
+struct VSGD {
+  static void apply(const double *__restrict__ g, double *__restrict__ G,
+                    double *__restrict__ V, double *__restrict__ Tau,
+                    double *__restrict__ w, arma::uword n, double rho,
+                    double tau);
+  static void catch_up(double *G, double *V, double *Tau, arma::uword n,
+                       arma::uword missed, double tau);
+};
+
+// out = w, read with relaxed atomic loads. Values that asynchronous workers
+// update in place (see Optimizer::set_shared()) are only read this way.
+inline void load_relaxed(const arma::mat &w, arma::mat &out) {
+  out.set_size(w.n_rows, w.n_cols);
+  double *src = const_cast<double *>(w.memptr()), *dst = out.memptr();
+  for (arma::uword i = 0; i < w.n_elem; ++i)
+    __atomic_load(src + i, dst + i, __ATOMIC_RELAXED);
+}
+
 class Optimizer {
 private:
-  ExampleIds all_examples;
   Serializable<arma::mat> *w;
   Serializable<arma::mat> G, V, Tau;
   double rho;
   double tau;
+  // number of sparse steps taken, and the step at which each column was
+  // last updated; columns are caught up lazily when next in a minibatch
+  arma::uword n_steps;
+  vector<arma::uword> last_step;
+
+  // the rule for algo, chosen once in setup()
+  void (Optimizer::*step)(const arma::mat &g, const ExampleIds &example_ids);
+  void (Optimizer::*dense_step)(const arma::mat &g);
+
+  template <class Rule>
+  void ascent(const arma::mat &g, const ExampleIds &example_ids);
+
+  template <class Rule> void ascent_dense(const arma::mat &g);
+
+  // w and the state are shared by asynchronous workers
+  bool shared;
+
+  // bumped after every change of w
+  uint64_t version_;
+  void bump() { __atomic_fetch_add(&version_, 1, __ATOMIC_RELEASE); }
+  template <class Rule> void ascent_shared(const arma::mat &g);
 
 public:
   string algo;
@@ -18,34 +79,84 @@ public:
         V(w->n_rows, w->n_cols, arma::fill::zeros),
         Tau(w->n_rows, w->n_cols, arma::fill::ones),
         algo(options.get<string>("algo")), rho(options.get<double>("rho")),
-        tau(options.get<double>("tau")) {
+        tau(options.get<double>("tau")), n_steps(0),
+        last_step(w->n_cols, 0), shared(false), version_(0) {
     setup();
   }
 
-  void setup() {
-    all_examples.clear();
-    for (arma::uword i = 0; i < w->n_cols; ++i)
-      all_examples.push_back(i);
+  void setup();
+
+  // Hogwild: dense updates from several threads at once, without locks.
+  // Every element is read and written with relaxed atomics, so concurrent
+  // updates of one element may be lost but never torn.
+  void set_shared(bool shared) {
+    this->shared = shared;
+    setup();
   }
 
-  void update(const arma::mat &g) { update(g, all_examples); }
+  // all columns: one pass over the whole contiguous state
+  void update(const arma::mat &g) {
+    (this->*dense_step)(g);
+    bump();
+  }
 
+  // column i of g updates column example_ids[i] of w; only these columns of
+  // w and of the optimizer state are touched
   void update(const arma::mat &g, const ExampleIds &example_ids) {
-    if (algo == "adagrad")
-      ada_ascent(g, example_ids);
-    else if (algo == "rmsprop")
-      rmsprop_ascent(g, example_ids);
-    else if (algo == "vsgd")
-      vsgd_ascent(g, example_ids);
-    else
-      throw runtime_error("unknown optimization algorithm");
+    (this->*step)(g, example_ids);
+    bump();
   }
 
-  void ada_ascent(const arma::mat &g, const ExampleIds &example_ids);
+  // sets w outright, e.g. to a closed-form update
+  void assign(const arma::mat &value) {
+    w->v() = value;
+    bump();
+  }
 
-  void rmsprop_ascent(const arma::mat &g, const ExampleIds &example_ids);
+  // changes whenever w does: values derived from w stay valid while it
+  // does not, see ParamCache
+  uint64_t version() const {
+    return __atomic_load_n(&version_, __ATOMIC_ACQUIRE);
+  }
 
-  void vsgd_ascent(const arma::mat &g, const ExampleIds &example_ids);
+  // the parameters and the optimizer state, as checkpointed
+  struct State {
+    Serializable<arma::mat> w, G, V, Tau;
+    arma::uword n_steps;
+    vector<arma::uword> last_step;
+
+    template <class Archive> void serialize(Archive &ar, const unsigned int) {
+      ar &w;
+      ar &G;
+      ar &V;
+      ar &Tau;
+      ar &n_steps;
+      ar &last_step;
+    }
+  };
+
+  // copies into state, reusing its buffers
+  void save_state(State &state) const {
+    state.w = *w;
+    state.G = G;
+    state.V = V;
+    state.Tau = Tau;
+    state.n_steps = n_steps;
+    state.last_step = last_step;
+  }
+
+  void load_state(const State &state) {
+    if (state.w.n_rows != w->n_rows || state.w.n_cols != w->n_cols ||
+        state.G.n_elem != G.n_elem)
+      throw runtime_error("checkpoint does not match the parameters");
+    w->v() = state.w;
+    G.v() = state.G;
+    V.v() = state.V;
+    Tau.v() = state.Tau;
+    n_steps = state.n_steps;
+    last_step = state.last_step;
+    bump();
+  }
 
   template <class Archive> void serialize(Archive &ar, const unsigned int) {
     ar &algo;
@@ -55,7 +166,12 @@ public:
     ar &V;
     ar &Tau;
     ar &w;
+    ar &n_steps;
+    ar &last_step;
     setup();
+    bump();
   }
-  Optimizer() : w(NULL), algo("") {}
+  Optimizer()
+      : w(NULL), n_steps(0), step(NULL), dense_step(NULL), shared(false),
+        version_(0), algo("") {}
 };
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <memory>
+#include <mutex>
+
+#include "utils.hpp"
+
+// Values derived from parameters (constrained parameters, digamma terms,
+// log-normalizers) that are only recomputed when the parameters move, i.e.
+// when the version of their optimizer changes, see Optimizer::version().
+// get() hands out a snapshot: a recompute by another thread publishes a new
+// one and never changes values in use.
+template <class T> class ParamCache {
+public:
+  ParamCache() {}
+  // copies start empty
+  ParamCache(const ParamCache &) {}
+  ParamCache &operator=(const ParamCache &) {
+    std::atomic_store(&entry, shared_ptr<const Entry>());
+    return *this;
+  }
+
+  // compute(T &) fills the values for the parameters at version
+  template <class Compute>
+  shared_ptr<const T> get(uint64_t version, Compute compute) {
+    shared_ptr<const Entry> e = std::atomic_load(&entry);
+    if (!e || e->version != version) {
+      lock_guard<mutex> lock(recompute);
+      e = std::atomic_load(&entry);
+      if (!e || e->version != version) {
+        shared_ptr<Entry> fresh(new Entry);
+        fresh->version = version;
+        compute(fresh->values);
+        e = fresh;
+        std::atomic_store(&entry, e);
+      }
+    }
+    return shared_ptr<const T>(e, &e->values);
+  }
+
+private:
+  struct Entry {
+    uint64_t version;
+    T values;
+  };
+  shared_ptr<const Entry> entry;
+  mutex recompute;
+};
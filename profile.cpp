@@ -0,0 +1,65 @@
+#include "profile.hpp"
+
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+const char *phase_names[N_PHASES] = {"sample",     "log_p", "log_q",
+                                     "likelihood", "score", "gradient",
+                                     "reduce",     "optimizer"};
+
+static std::atomic<bool> counting(false);
+static std::atomic<uint64_t> allocations(0);
+
+void count_allocations(bool enable) { counting = enable; }
+
+uint64_t n_allocations() { return allocations.load(std::memory_order_relaxed); }
+
+static inline void count_allocation() {
+  if (counting.load(std::memory_order_relaxed))
+    allocations.fetch_add(1, std::memory_order_relaxed);
+}
+
+#ifdef COUNT_MALLOC
+// The linker redirects every call to these from the program's objects here
+// (-Wl,--wrap=malloc, ...) and __real_* to the C library.
+extern "C" {
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t n, size_t size);
+void *__real_realloc(void *p, size_t size);
+int __real_posix_memalign(void **p, size_t alignment, size_t size);
+
+void *__wrap_malloc(size_t size) {
+  count_allocation();
+  return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t n, size_t size) {
+  count_allocation();
+  return __real_calloc(n, size);
+}
+
+void *__wrap_realloc(void *p, size_t size) {
+  count_allocation();
+  return __real_realloc(p, size);
+}
+
+int __wrap_posix_memalign(void **p, size_t alignment, size_t size) {
+  count_allocation();
+  return __real_posix_memalign(p, alignment, size);
+}
+}
+#endif
+
+// Replaces the global allocation functions; the array and nothrow forms call
+// these. With COUNT_MALLOC the malloc below is already counted.
+void *operator new(size_t size) {
+#ifndef COUNT_MALLOC
+  count_allocation();
+#endif
+  if (void *p = malloc(size ? size : 1))
+    return p;
+  throw std::bad_alloc();
+}
+
+void operator delete(void *p) noexcept { free(p); }
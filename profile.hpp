@@ -0,0 +1,47 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+
+// Phases of a training iteration, timed by every training step. Phases run
+// inside the parallel sample loop are summed over the samples, so they add
+// up to thread-seconds rather than wall-clock seconds.
+enum Phase {
+  PHASE_SAMPLE,
+  PHASE_LOG_P,
+  PHASE_LOG_Q,
+  PHASE_LIKELIHOOD,
+  PHASE_SCORE,
+  PHASE_GRADIENT,
+  PHASE_REDUCE,
+  PHASE_OPTIMIZER,
+  N_PHASES
+};
+
+extern const char *phase_names[N_PHASES];
+
+// Seconds between successive laps.
+class Timer {
+public:
+  Timer() : last(std::chrono::steady_clock::now()) {}
+
+  double lap() {
+    auto now = std::chrono::steady_clock::now();
+    double seconds = std::chrono::duration<double>(now - last).count();
+    last = now;
+    return seconds;
+  }
+
+private:
+  std::chrono::steady_clock::time_point last;
+};
+
+// Number of allocations so far, from any thread. Counting is a relaxed
+// atomic increment and only happens once enabled. Built with COUNT_MALLOC
+// (Linux, see wscript), calls to malloc, calloc, realloc and posix_memalign
+// from the program's own code are counted, which includes Armadillo's matrix
+// memory and operator new, but not allocations inside shared libraries such
+// as GSL or BLAS. Otherwise only operator new calls are counted, which misses
+// every Armadillo matrix.
+void count_allocations(bool enable);
+uint64_t n_allocations();
@@ -0,0 +1,228 @@
+#include "random.hpp"
+
+#include <cmath>
+#include <gsl/gsl_sf_gamma.h>
+#include <stdexcept>
+#include <vector>
+
+namespace {
+
+struct PhiloxState {
+  uint32_t key[2];
+  // counter: 64-bit block index, then the stream id
+  uint32_t ctr[4];
+  uint32_t out[4];
+  int used;
+};
+
+inline void mulhilo(uint32_t a, uint32_t b, uint32_t &hi, uint32_t &lo) {
+  uint64_t p = (uint64_t)a * b;
+  hi = p >> 32;
+  lo = (uint32_t)p;
+}
+
+// the ten rounds of Philox4x32 on one counter
+inline void philox_block(const uint32_t *key, const uint32_t *ctr,
+                         uint32_t *out) {
+  uint32_t k0 = key[0], k1 = key[1];
+  uint32_t c0 = ctr[0], c1 = ctr[1], c2 = ctr[2], c3 = ctr[3];
+  for (int r = 0; r < 10; ++r) {
+    uint32_t hi0, lo0, hi1, lo1;
+    mulhilo(0xD2511F53u, c0, hi0, lo0);
+    mulhilo(0xCD9E8D57u, c2, hi1, lo1);
+    c0 = hi1 ^ c1 ^ k0;
+    c1 = lo1;
+    c2 = hi0 ^ c3 ^ k1;
+    c3 = lo0;
+    k0 += 0x9E3779B9u;
+    k1 += 0xBB67AE85u;
+  }
+  out[0] = c0;
+  out[1] = c1;
+  out[2] = c2;
+  out[3] = c3;
+}
+
+inline void next_ctr(uint32_t *ctr) {
+  if (++ctr[0] == 0)
+    ++ctr[1];
+}
+
+void philox_set(void *vstate, unsigned long seed) {
+  auto state = (PhiloxState *)vstate;
+  uint64_t s = seed;
+  state->key[0] = (uint32_t)s;
+  state->key[1] = (uint32_t)(s >> 32);
+  for (int i = 0; i < 4; ++i)
+    state->ctr[i] = 0;
+  state->used = 4;
+}
+
+unsigned long philox_get(void *vstate) {
+  auto state = (PhiloxState *)vstate;
+  if (state->used == 4) {
+    philox_block(state->key, state->ctr, state->out);
+    next_ctr(state->ctr);
+    state->used = 0;
+  }
+  return state->out[state->used++];
+}
+
+inline double to_open_unit(uint32_t x) { return (x + 0.5) / 4294967296.0; }
+
+double philox_get_double(void *vstate) {
+  return philox_get(vstate) / 4294967296.0;
+}
+
+const gsl_rng_type philox_type = {"philox4x32", 0xffffffffUL, 0,
+                                  sizeof(PhiloxState), &philox_set,
+                                  &philox_get, &philox_get_double};
+
+PhiloxState *philox_state(gsl_rng *rng) {
+  return rng->type == &philox_type ? (PhiloxState *)rng->state : NULL;
+}
+
+} // namespace
+
+const gsl_rng_type *gsl_rng_philox = &philox_type;
+
+void rng_set_stream(gsl_rng *rng, uint32_t a, uint32_t b) {
+  auto state = philox_state(rng);
+  if (!state)
+    throw std::runtime_error("rng_set_stream needs a philox rng");
+  state->ctr[0] = state->ctr[1] = 0;
+  state->ctr[2] = b;
+  state->ctr[3] = a;
+  state->used = 4;
+}
+
+uint64_t uniform_index(gsl_rng *rng, uint64_t n) {
+  unsigned long range = gsl_rng_max(rng) - gsl_rng_min(rng);
+  if (n - 1 <= range)
+    return gsl_rng_uniform_int(rng, n);
+  if (range != 0xffffffffUL)
+    throw std::runtime_error("uniform_index needs 32-bit draws above 2^32");
+  // two draws make 64 bits; the partial copy of [0, n) at the top is
+  // rejected so that every index stays equally likely
+  uint64_t limit = UINT64_MAX / n * n, r;
+  do {
+    uint64_t hi = gsl_rng_get(rng) - gsl_rng_min(rng);
+    uint64_t lo = gsl_rng_get(rng) - gsl_rng_min(rng);
+    r = hi << 32 | lo;
+  } while (r >= limit);
+  return r % n;
+}
+
+void fill_uniform(gsl_rng *rng, double *out, size_t n) {
+  auto state = philox_state(rng);
+  if (!state) {
+    for (size_t i = 0; i < n; ++i)
+      out[i] = gsl_rng_uniform_pos(rng);
+    return;
+  }
+  size_t i = 0;
+  // what is left of the current block first, so that bulk and scalar draws
+  // interleave as one stream
+  while (i < n && state->used < 4)
+    out[i++] = to_open_unit(state->out[state->used++]);
+  uint32_t block[4];
+  for (; i + 4 <= n; i += 4) {
+    philox_block(state->key, state->ctr, block);
+    next_ctr(state->ctr);
+    for (int j = 0; j < 4; ++j)
+      out[i + j] = to_open_unit(block[j]);
+  }
+  while (i < n)
+    out[i++] = to_open_unit(philox_get(state));
+}
+
+void fill_normal(gsl_rng *rng, double *out, size_t n) {
+  size_t n_even = n & ~(size_t)1;
+  fill_uniform(rng, out, n_even);
+  for (size_t i = 0; i < n_even; i += 2) {
+    double r = std::sqrt(-2 * std::log(out[i]));
+    double theta = 2 * M_PI * out[i + 1];
+    out[i] = r * std::cos(theta);
+    out[i + 1] = r * std::sin(theta);
+  }
+  if (n_even < n) {
+    double u[2];
+    fill_uniform(rng, u, 2);
+    out[n_even] = std::sqrt(-2 * std::log(u[0])) * std::cos(2 * M_PI * u[1]);
+  }
+}
+
+void fill_gamma(gsl_rng *rng, const double *shape, double *out, size_t n) {
+  // the uniforms u_boost that boost shapes below 1 to shape + 1, one per
+  // draw, then rounds of one proposal normal and one acceptance uniform per
+  // pending draw; about 1 in 20 proposals is rejected and retried in the
+  // next round
+  static thread_local std::vector<double> u_boost, x, u;
+  static thread_local std::vector<size_t> pending, rejected;
+  u_boost.resize(n);
+  fill_uniform(rng, u_boost.data(), n);
+  pending.resize(n);
+  for (size_t i = 0; i < n; ++i)
+    pending[i] = i;
+  while (!pending.empty()) {
+    size_t m = pending.size();
+    x.resize(m);
+    u.resize(m);
+    fill_normal(rng, x.data(), m);
+    fill_uniform(rng, u.data(), m);
+    const size_t *idx = pending.data();
+    const double *x_ = x.data(), *u_ = u.data();
+#pragma omp simd
+    for (size_t j = 0; j < m; ++j) {
+      size_t i = idx[j];
+      double a = shape[i] < 1 ? shape[i] + 1 : shape[i];
+      double d = a - 1.0 / 3, c = 1 / std::sqrt(9 * d);
+      double v = 1 + c * x_[j];
+      v = v * v * v;
+      double x2 = x_[j] * x_[j];
+      double log_v = std::log(v > 0 ? v : 1);
+      bool ok = v > 0 && (u_[j] < 1 - 0.0331 * x2 * x2 ||
+                          std::log(u_[j]) < 0.5 * x2 + d * (1 - v + log_v));
+      out[i] = ok ? d * v : -1;
+    }
+    rejected.clear();
+    for (size_t j = 0; j < m; ++j)
+      if (out[idx[j]] < 0)
+        rejected.push_back(idx[j]);
+    pending.swap(rejected);
+  }
+  for (size_t i = 0; i < n; ++i)
+    if (shape[i] < 1)
+      out[i] *= std::pow(u_boost[i], 1 / shape[i]);
+}
+
+// log Q(shape, x) = log(1 - P(shape, x)) if upper, otherwise log P(shape, x)
+// from the series P = x^shape e^-x / Gamma(shape + 1) sum_n x^n / ((shape +
+// 1) ... (shape + n)), which does not underflow however small x is
+static double log_gamma_inc(double shape, double x, bool upper) {
+  if (upper)
+    return std::log(gsl_sf_gamma_inc_Q(shape, x));
+  double term = 1, sum = 1;
+  for (int n = 1; n < 1000 && term > 1e-17 * sum; ++n) {
+    term *= x / (shape + n);
+    sum += term;
+  }
+  return shape * std::log(x) - x - gsl_sf_lngamma(shape + 1) + std::log(sum);
+}
+
+double gamma_grad_shape(double x, double shape) {
+  if (x <= 0)
+    return 0;
+  double h = 1e-5 * shape;
+  double log_pdf = (shape - 1) * std::log(x) - x - gsl_sf_lngamma(shape);
+  // P(shape -+ h, x) / p(x; shape) in log space: for small shapes and tiny
+  // x both P and p are far outside the range of a double, their ratio is
+  // not. In the upper tail dP = -dQ, and Q does not cancel like 1 - P.
+  bool upper = x >= shape + 1;
+  double lo = log_gamma_inc(shape - h, x, upper) - log_pdf;
+  double hi = log_gamma_inc(shape + h, x, upper) - log_pdf;
+  double grad = std::exp(lo) * std::expm1(hi - lo) / (2 * h);
+  if (!upper)
+    grad = -grad;
+  return std::isfinite(grad) ? grad : 0;
+}
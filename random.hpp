@@ -2,14 +2,54 @@
 #define RANDOM
 
 #include <boost/noncopyable.hpp>
+#include <boost/serialization/access.hpp>
+#include <boost/serialization/array_wrapper.hpp>
+#include <boost/serialization/split_member.hpp>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
 #include <gsl/gsl_rng.h>
 
+// Counter-based generator (Philox4x32-10, Salmon et al. 2011) as a GSL rng
+// type, so that gsl_ran_* draw from it. The seed is the key; the counter
+// holds a stream id and the position in the stream, so any draw can be
+// reached without generating the ones before it.
+extern const gsl_rng_type *gsl_rng_philox;
+
+// Restarts a philox rng at the beginning of stream (a, b) of its seed, e.g.
+// (iteration, sample). Streams never overlap, so draws do not depend on
+// which thread makes them.
+void rng_set_stream(gsl_rng *rng, uint32_t a, uint32_t b);
+
+// uniform on [0, n) for any 64-bit n; gsl_rng_uniform_int only reaches the
+// range of one draw, 2^32 for philox
+uint64_t uniform_index(gsl_rng *rng, uint64_t n);
+
+// Whole buffers at once; with a philox rng the uniforms are generated four
+// per block without going through gsl_rng_get.
+// uniforms on (0, 1)
+void fill_uniform(gsl_rng *rng, double *out, size_t n);
+// standard normals, Box-Muller on pairs of uniforms
+void fill_normal(gsl_rng *rng, double *out, size_t n);
+// out[i] ~ Gamma(shape[i], 1), Marsaglia-Tsang with every proposal drawn in
+// bulk and tested in one vectorizable pass; the few rejected draws are
+// retried together in further rounds. Shapes below 1 are boosted to shape + 1
+// and scaled by u^(1 / shape).
+void fill_gamma(gsl_rng *rng, const double *shape, double *out, size_t n);
+
+// Implicit reparameterization (Figurnov et al. 2018) of a Gamma(shape, 1)
+// draw x: dx / dshape = -(dP(shape, x) / dshape) / p(x; shape), with P the
+// CDF, whatever sampler drew x. dP / dshape is a central difference, taken
+// relative to p(x; shape) in log space so that it stays finite for tiny x.
+double gamma_grad_shape(double x, double shape);
+
 // Not Copy Safe
 struct GSLRandom : boost::noncopyable
 {
 public:
-  inline GSLRandom() {
-    rng = gsl_rng_alloc(gsl_rng_taus);
+  inline GSLRandom(const gsl_rng_type *type = gsl_rng_philox) {
+    rng = gsl_rng_alloc(type);
   }
   ~GSLRandom() {
     gsl_rng_free(rng);
@@ -27,10 +67,9 @@ public:
     size_t size = rng->type->size;
     const char* mem = static_cast<char*>(rng->state);
 
+    // byte for byte the same archive as one element at a time
     ar & size;
-    for (size_t i = 0; i < size; ++i) {
-      ar & mem[i];
-    }
+    ar & boost::serialization::make_array(mem, size);
   }
 
   template<typename Archive>
@@ -40,9 +79,7 @@ public:
 
     assert(rng->type->size == size);
     char* mem = new char[size];
-    for (size_t i = 0; i < size; ++i) {
-      ar & mem[i];
-    }
+    ar & boost::serialization::make_array(mem, size);
 
     memcpy(rng->state, mem, size);
     delete[] mem;
@@ -26,46 +26,53 @@
 
 // STL
 #include <boost/serialization/vector.hpp>
+#include <boost/serialization/array_wrapper.hpp>
+#include <boost/serialization/version.hpp>
 
 #include <boost/iostreams/device/file.hpp>
 #include <boost/iostreams/filtering_stream.hpp>         //allows the use of filters like gzip that are automatically applied when reading from or writing to a file
 #include <boost/iostreams/filter/gzip.hpp>              //allows gzip (de)compression
 
+// Version 1 of a serialized matrix stores its elements in column-major
+// order, i.e. its memory, as one array: binary archives then read and write
+// the whole block at once. Version 0 (row-major, one element at a time) is
+// still loaded.
+const unsigned int serializable_version = 1;
+
 // Vector
 template<typename Archive>
-void serialize_helper(Archive& ar, const arma::vec& v) {
+void serialize_helper(Archive& ar, const arma::vec& v, const unsigned int) {
   ar & v.n_elem;
-  for (arma::uword i = 0; i < v.n_elem; ++i)
-    ar & v(i);
+  ar & boost::serialization::make_array(v.memptr(), v.n_elem);
 }
 
 template<typename Archive>
-void deserialize_helper(Archive& ar, arma::vec* v) {
+void deserialize_helper(Archive& ar, arma::vec* v, const unsigned int) {
   arma::uword n_elem;
   ar & n_elem;
-  v->resize(n_elem);
-  for (arma::uword i = 0; i < v->n_elem; ++i)
-    ar & (*v)(i);
+  v->set_size(n_elem);
+  ar & boost::serialization::make_array(v->memptr(), v->n_elem);
 }
 
 // Matrix
 template<typename Archive>
-void serialize_helper(Archive& ar, const arma::mat& m) {
+void serialize_helper(Archive& ar, const arma::mat& m, const unsigned int) {
   ar & m.n_rows;
   ar & m.n_cols;
-
-  for (arma::uword r = 0; r < m.n_rows; ++r)
-    for (arma::uword c = 0; c < m.n_cols; ++c)
-      ar & m(r, c);
+  ar & boost::serialization::make_array(m.memptr(), m.n_elem);
 }
 
 template<typename Archive>
-void deserialize_helper(Archive& ar, arma::mat* m) {
+void deserialize_helper(Archive& ar, arma::mat* m, const unsigned int version) {
   arma::uword n_rows, n_cols;
   ar & n_rows;
   ar & n_cols;
   m->set_size(n_rows, n_cols);
 
+  if (version >= 1) {
+    ar & boost::serialization::make_array(m->memptr(), m->n_elem);
+    return;
+  }
   for (arma::uword r = 0; r < m->n_rows; ++r)
     for (arma::uword c = 0; c < m->n_cols; ++c)
       ar & (*m)(r, c);
@@ -89,16 +96,28 @@ class Serializable: public T {
 
   // Serialization
   template<class Archive>
-  inline void save(Archive& ar, const unsigned int) const {
-    serialize_helper(ar, *static_cast<const T*>(this));
+  inline void save(Archive& ar, const unsigned int version) const {
+    serialize_helper(ar, *static_cast<const T*>(this), version);
   }
 
   template<class Archive>
-  inline void load(Archive& ar, const unsigned int) {
-    deserialize_helper(ar, static_cast<T*>(this));
+  inline void load(Archive& ar, const unsigned int version) {
+    deserialize_helper(ar, static_cast<T*>(this), version);
   }
 };
 
+// BOOST_CLASS_VERSION for the Serializable template
+namespace boost {
+namespace serialization {
+template<typename T>
+struct version<Serializable<T> > {
+  typedef mpl::int_<serializable_version> type;
+  typedef mpl::integral_c_tag tag;
+  BOOST_STATIC_CONSTANT(int, value = version::type::value);
+};
+}
+}
+
 // Writes (Erase and Writes) a file containing the object
 template<typename Archive, typename Object>
 inline void serialize(const std::string& filename, const Object& o) {
@@ -14,7 +14,5 @@ typedef vector<arma::uword> ExampleIds;
 typedef vector<shared_ptr<arma::rowvec>> VecOfRow;
 typedef vector<std::shared_ptr<arma::mat>> VecOfMat;
 typedef vector<std::shared_ptr<arma::cube>> VecOfCube;
-typedef map<string, VecOfMat> MapVecOfMat;
-typedef map<string, std::shared_ptr<arma::mat>> MapOfMat;
 
 namespace pt = boost::property_tree;
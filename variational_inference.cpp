@@ -1,58 +1,170 @@
 #include "variational_inference.hpp"
 
+#include <chrono>
+#include <omp.h>
+
 VariationalInference::TrainStats
 VariationalInference::train_batch_global(const ExampleIds &example_ids) {
-  auto samples = n_samples;
-  TrainStats stats(iteration++, samples);
+  TrainStats stats(iteration++, n_samples);
+  step_global(workspace, example_ids, threads, stats);
+  return stats;
+}
 
-  vector<MapOfMat> z_samples;
-  z_samples.resize(samples);
+void VariationalInference::step_global(Workspace &ws,
+                                       const ExampleIds &example_ids,
+                                       int threads, TrainStats &stats) {
+  auto samples = n_samples;
+  Packed &z_samples = ws.z_samples;
+  arma::rowvec &samples_log_p = ws.samples_log_p;
+  arma::rowvec &samples_log_q = ws.samples_log_q;
 
-  VecOfMat samples_log_p, samples_log_q;
-  samples_log_p.resize(samples);
-  samples_log_q.resize(samples);
+  auto sampling_ratio = (example_ids.size() + 0.0) / n_examples;
+  auto observations = options.get<bool>("observations");
+  const arma::mat *batch = NULL;
+  if (observations)
+    batch = &data->slice_view(example_ids);
 
-  MapVecOfMat samples_score_q;
+  // leaves that sample in batches draw every sample at once
+  Timer batch_timer;
+  variational->samples_batch_into(ws.batch_rng(stats.iteration), z_samples,
+                                  reparam ? &ws.noise : NULL);
+  stats.seconds(PHASE_SAMPLE) += batch_timer.lap();
 
+  // every sample draws from its own stream, so the result does not depend
+  // on the number of threads
+#pragma omp parallel for num_threads(threads) schedule(static)
   for (int s = 0; s < samples; ++s) {
-    gsl_rng *rng = vec_rng[s]->rng;
+    Timer timer;
+    double *seconds = stats.sample_seconds.colptr(s);
+    gsl_rng *rng = ws.sample_rng(stats.iteration, s);
 
-    z_samples[s] = variational->samples(rng);
+    if (reparam)
+      variational->samples_path_into(rng, z_samples, ws.noise, s, true);
+    else
+      variational->samples_into(rng, z_samples, s, true);
+    seconds[PHASE_SAMPLE] += timer.lap();
 
-    if (s == 0) {
-      for (const auto &p : z_samples[s])
-        samples_score_q[p.first].resize(samples);
-    }
-    auto sample_score_q = variational->grad_lq_matrix(z_samples[s]);
+    samples_log_p(s) = model->compute_log_p(z_samples, s);
+    seconds[PHASE_LOG_P] += timer.lap();
+
+    samples_log_q(s) = variational->compute_log_q(z_samples, s);
+    seconds[PHASE_LOG_Q] += timer.lap();
 
-    samples_log_p[s] = model->log_p_matrix(z_samples[s]);
+    // renormalize
+    samples_log_p(s) *= sampling_ratio;
+    samples_log_q(s) *= sampling_ratio;
+
+    // compute log-likelihood of the data
+    if (observations)
+      samples_log_p(s) +=
+          arma::accu(model->log_lik_matrix(*batch, z_samples, s));
+    seconds[PHASE_LIKELIHOOD] += timer.lap();
 
-    samples_log_q[s] = variational->log_q_matrix(z_samples[s]);
+    stats.elbo(s) = samples_log_p(s) - samples_log_q(s);
 
-    for (const auto &p : z_samples[s]) {
-      samples_score_q[p.first][s] = sample_score_q[p.first];
+    // renormalized like log p above
+    if (reparam) {
+      model->grad_log_joint(batch, z_samples, s, sampling_ratio, ws.grad_z);
+      seconds[PHASE_SCORE] += timer.lap();
     }
+  }
+  stats.seconds += arma::sum(stats.sample_seconds, 1);
 
-    auto sampling_ratio = -1.0;
-    sampling_ratio = (example_ids.size() + 0.0) / n_examples;
+  Timer timer;
+  BBVIStats bbvi_stats;
+  if (reparam) {
+    variational->estimate_grad_path(z_samples, ws.noise, ws.grad_z,
+                                    sampling_ratio, ws.grads, threads);
+    stats.seconds(PHASE_GRADIENT) += timer.lap();
+  } else {
+    // scores of all samples at once, parameter terms computed once
+    variational->grad_lq(z_samples, ws.score_samples, threads);
+    stats.seconds(PHASE_SCORE) += timer.lap();
 
-    // renormalize
-    *samples_log_p[s] *= sampling_ratio;
-    *samples_log_q[s] *= sampling_ratio;
+    bbvi_stats = variational->estimate_grad(
+        ws.score_samples, samples_log_p, samples_log_q, ws.grads, threads);
+    stats.seconds(PHASE_GRADIENT) += timer.lap();
+  }
+  if (allreduce) {
+    reduce_global(ws, bbvi_stats, stats);
+    stats.seconds(PHASE_REDUCE) += timer.lap();
+  }
+  stats.bbvi_stats_z.push_back(bbvi_stats);
+  variational->apply_grad(ws.grads, threads);
+  stats.seconds(PHASE_OPTIMIZER) += timer.lap();
+}
+
+// One all-reduce of the packed gradients and one of the statistics. Every
+// process then applies the same mean gradient, so the parameters stay
+// identical without being broadcast.
+void VariationalInference::reduce_global(Workspace &ws, BBVIStats &bbvi_stats,
+                                         TrainStats &stats) {
+  double n = allreduce->size();
+  arma::vec &grads = ws.grads.values();
+  allreduce->sum(grads);
+  grads /= n;
+
+  arma::uword n_elbo = stats.elbo.n_elem;
+  reduced_stats.set_size(4 + n_elbo);
+  reduced_stats(0) = bbvi_stats.mean_sqr_g0;
+  reduced_stats(1) = bbvi_stats.var_g0;
+  reduced_stats(2) = bbvi_stats.mean_sqr_g1;
+  reduced_stats(3) = bbvi_stats.var_g1;
+  reduced_stats.tail(n_elbo) = stats.elbo;
+  allreduce->sum(reduced_stats);
+  reduced_stats /= n;
+  bbvi_stats.mean_sqr_g0 = reduced_stats(0);
+  bbvi_stats.var_g0 = reduced_stats(1);
+  bbvi_stats.mean_sqr_g1 = reduced_stats(2);
+  bbvi_stats.var_g1 = reduced_stats(3);
+  stats.elbo = reduced_stats.tail(n_elbo);
+}
+
+VariationalInference::TrainStats
+VariationalInference::train_batch(const ExampleIds &example_ids) {
+  auto samples = n_samples;
+  TrainStats stats(iteration++, samples);
+
+  auto observations = options.get<bool>("observations");
+  const arma::mat *batch = NULL;
+  if (observations)
+    batch = &data->slice_view(example_ids);
+
+  // only the latents of the minibatch are sampled; each example's own terms
+  // weight its own scores, so no renormalization is needed
+#pragma omp parallel for num_threads(threads) schedule(static)
+  for (int s = 0; s < samples; ++s) {
+    Timer timer;
+    double *seconds = stats.sample_seconds.colptr(s);
+    gsl_rng *rng = workspace.sample_rng(stats.iteration, s);
+
+    auto z = variational->sample_matrix(rng, example_ids);
+    seconds[PHASE_SAMPLE] += timer.lap();
+
+    variational->grad_lq_local(*z, example_ids, local_score, s);
+    seconds[PHASE_SCORE] += timer.lap();
+
+    arma::rowvec log_p = *model->log_p_matrix(z);
+    seconds[PHASE_LOG_P] += timer.lap();
 
     // compute log-likelihood of the data
-    if (options.get<bool>("observations")) {
-      for (int i = 0; i < example_ids.size(); ++i) {
-        *samples_log_p[s] +=
-            model->compute_log_lik(data->slice_data(example_ids), z_samples[s]);
-      }
-    }
+    if (observations)
+      log_p += model->log_lik_matrix(*batch, *z);
+    seconds[PHASE_LIKELIHOOD] += timer.lap();
 
-    stats.elbo(s) += arma::accu(*samples_log_p[s]);
-    stats.elbo(s) -= arma::accu(*samples_log_q[s]);
+    local_log_p.col(s) = log_p.t();
+    local_log_q.col(s) = *variational->log_q_matrix(z, example_ids);
+    seconds[PHASE_LOG_Q] += timer.lap();
+
+    stats.elbo(s) = arma::accu(local_log_p.col(s) - local_log_q.col(s));
   }
+  stats.seconds += arma::sum(stats.sample_seconds, 1);
 
-  variational->update(samples_score_q, samples_log_p, samples_log_q);
+  // the lazy column updates estimate and apply each gradient in one go
+  Timer timer;
+  stats.bbvi_stats_z.push_back(variational->update_local(
+      local_score, example_ids, local_log_p, local_log_q, threads));
+  stats.seconds(PHASE_GRADIENT) += timer.lap();
 
   return stats;
 }
@@ -62,35 +174,253 @@ void VariationalInference::print_stats(const TrainStats &stats) {
          arma::mean(stats.elbo), arma::stddev(stats.elbo));
 }
 
-static ExampleIds gen_example_ids(gsl_rng *rng, const string &batch_order,
-                                  int batch_size, int n_examples,
-                                  int *batch_st) {
+void VariationalInference::write_profile(FILE *f, const TrainStats &stats,
+                                         double seconds, uint64_t allocations,
+                                         size_t batch_size) {
+  BBVIStats bbvi;
+  for (const auto &b : stats.bbvi_stats_z)
+    bbvi += b;
+  if (!stats.bbvi_stats_z.empty())
+    bbvi /= stats.bbvi_stats_z.size();
+  fprintf(f,
+          "{\"iteration\":%d,\"seconds\":%.6g,\"samples_per_s\":%.6g,"
+          "\"examples_per_s\":%.6g,\"allocations\":%llu,\"elbo_mean\":%.9g,"
+          "\"elbo_std\":%.9g,\"mean_sqr_g0\":%.9g,\"var_g0\":%.9g,"
+          "\"mean_sqr_g1\":%.9g,\"var_g1\":%.9g",
+          stats.iteration, seconds, stats.elbo.n_elem / seconds,
+          batch_size / seconds, (unsigned long long)allocations,
+          arma::mean(stats.elbo), arma::stddev(stats.elbo), bbvi.mean_sqr_g0,
+          bbvi.var_g0, bbvi.mean_sqr_g1, bbvi.var_g1);
+  for (int p = 0; p < N_PHASES; ++p)
+    fprintf(f, ",\"%s_s\":%.6g", phase_names[p], stats.seconds(p));
+  fprintf(f, "}\n");
+}
+
+// draws a minibatch from the n_resident examples starting at resident_begin
+ExampleIds gen_example_ids(gsl_rng *rng, const string &batch_order,
+                           int batch_size, arma::uword resident_begin,
+                           arma::uword n_resident, arma::uword *batch_st) {
 
-  (*batch_st) %= n_examples;
+  (*batch_st) %= n_resident;
   ExampleIds examples;
   for (int j = 0; j < batch_size; ++j) {
     if (batch_order == "seq") {
-      examples.push_back((*batch_st));
+      examples.push_back(resident_begin + (*batch_st));
       ++(*batch_st);
-      (*batch_st) %= n_examples;
+      (*batch_st) %= n_resident;
     } else {
-      (*batch_st) = gsl_rng_get(rng) % n_examples;
-      examples.push_back(*batch_st);
+      (*batch_st) = uniform_index(rng, n_resident);
+      examples.push_back(resident_begin + *batch_st);
     }
   }
   return examples;
 }
 
 void VariationalInference::train() {
+  if (options.get<int>("async.workers", 0) > 0) {
+    if (allreduce)
+      throw runtime_error("async training runs in a single process");
+    // workers have no common point at which to snapshot or time an iteration
+    if (!options.get<string>("checkpoint.path", "").empty())
+      throw runtime_error("async training does not support checkpoints");
+    if (!options.get<string>("profile.file", "").empty())
+      throw runtime_error("async training does not support profiling");
+    train_async();
+    return;
+  }
+  if (allreduce && variational->is_local())
+    throw runtime_error("distributed training only updates global parameters");
+  if (reparam && variational->is_local())
+    throw runtime_error("the reparam estimator only updates global parameters");
   auto batch_size = options.get<int>("batch_size");
-  ExampleIds ex = gen_example_ids(vec_rng[0]->rng, "seq", batch_size,
-                                  n_examples, &batch_size);
-  for (auto i = 0; i < options.get<int>("n_iterations"); i++) {
-    /* auto train_stats = train_batch(ex); */
-    auto train_stats = train_batch_global(ex);
-    if (i % options.get<int>("print_every") == 0) {
+  auto batch_order = options.get<string>("batch_order", "seq");
+  arma::uword batch_st = 0, n_drawn = 0;
+  int rank = allreduce ? allreduce->rank() : 0;
+
+  shared_ptr<Checkpointer> checkpointer;
+  auto checkpoint_path = options.get<string>("checkpoint.path", "");
+  auto checkpoint_every = options.get<int>("checkpoint.every", 0);
+  if (!checkpoint_path.empty()) {
+    // processes of one job draw different minibatches
+    if (allreduce)
+      checkpoint_path += "." + to_string(rank);
+    checkpointer = make_shared<Checkpointer>(checkpoint_path);
+    TrainState state;
+    if (options.get<bool>("checkpoint.resume", true) &&
+        load_resume_state(*checkpointer, allreduce.get(), state)) {
+      restore_checkpoint(state, batch_st, n_drawn);
+      if (rank == 0)
+        printf("Resumed from %s at iteration %d\n", checkpoint_path.c_str(),
+               iteration);
+    }
+  }
+
+  // [profile]: one line per profile.every iterations, rank 0 only
+  FILE *profile = NULL;
+  auto profile_file = options.get<string>("profile.file", "");
+  auto profile_every = options.get<int>("profile.every", 1);
+  if (!profile_file.empty() && rank == 0) {
+    profile = fopen(profile_file.c_str(), "a");
+    if (!profile)
+      throw runtime_error("cannot open " + profile_file);
+    count_allocations(true);
+  }
+
+  for (auto i = iteration; i < options.get<int>("n_iterations"); i++) {
+    // rotate chunks once as many examples as the chunk holds were drawn;
+    // the resident examples are this process's own
+    if (n_drawn >= data->resident_size()) {
+      if (data->next_chunk())
+        batch_st = 0;
+      n_drawn = 0;
+    }
+    rng_set_stream(batch_rng->rng, iteration, n_samples);
+    ExampleIds ex = gen_example_ids(batch_rng->rng, batch_order, batch_size,
+                                    data->resident_begin(),
+                                    data->resident_size(), &batch_st);
+    n_drawn += batch_size;
+    Timer timer;
+    auto allocations = n_allocations();
+    auto train_stats = variational->is_local() ? train_batch(ex)
+                                               : train_batch_global(ex);
+    if (profile && i % profile_every == 0)
+      write_profile(profile, train_stats, timer.lap(),
+                    n_allocations() - allocations, batch_size);
+    if (rank == 0 && i % options.get<int>("print_every") == 0) {
       print_stats(train_stats);
       variational->print();
     }
+    if (checkpointer && checkpoint_every > 0 &&
+        iteration % checkpoint_every == 0)
+      save_checkpoint(*checkpointer, batch_st, n_drawn);
+  }
+  if (checkpointer) {
+    save_checkpoint(*checkpointer, batch_st, n_drawn);
+    checkpointer->wait();
+  }
+  if (profile) {
+    count_allocations(false);
+    fclose(profile);
+  }
+}
+
+// Only the copy happens here; the checkpointer writes it in the background.
+void VariationalInference::save_checkpoint(Checkpointer &checkpointer,
+                                           arma::uword batch_st,
+                                           arma::uword n_drawn) {
+  TrainState &state = checkpointer.snapshot();
+  checkpoint_barrier(allreduce.get());
+  state.iteration = iteration;
+  state.batch_st = batch_st;
+  state.n_drawn = n_drawn;
+  state.resident_begin = data->resident_begin();
+
+  vector<Optimizer *> optimizers;
+  variational->collect_optimizers(optimizers);
+  state.optimizers.resize(optimizers.size());
+  for (size_t k = 0; k < optimizers.size(); ++k)
+    optimizers[k]->save_state(state.optimizers[k]);
+
+  // the per-thread rngs are set to the stream of every sample before use,
+  // so only the minibatch rng is saved and n_threads may change on resume
+  state.rngs.resize(1);
+  save_rng(batch_rng->rng, state.rngs[0]);
+  checkpointer.save();
+}
+
+void VariationalInference::restore_checkpoint(const TrainState &state,
+                                              arma::uword &batch_st,
+                                              arma::uword &n_drawn) {
+  vector<Optimizer *> optimizers;
+  variational->collect_optimizers(optimizers);
+  // older checkpoints also hold per-thread rngs, which are ignored
+  if (state.optimizers.size() != optimizers.size() || state.rngs.empty())
+    throw runtime_error("checkpoint does not match the model");
+  for (size_t k = 0; k < optimizers.size(); ++k)
+    optimizers[k]->load_state(state.optimizers[k]);
+
+  load_rng(batch_rng->rng, state.rngs[0]);
+
+  // streamed data: move on to the chunk that was resident
+  for (arma::uword c = 0; data->resident_begin() != state.resident_begin;
+       ++c)
+    if (!data->next_chunk() || c > data->n_examples())
+      throw runtime_error("checkpoint does not match the data");
+
+  iteration = state.iteration;
+  batch_st = state.batch_st;
+  n_drawn = state.n_drawn;
+}
+
+void VariationalInference::train_async() {
+  auto workers = options.get<int>("async.workers");
+  auto n_iterations = options.get<int>("n_iterations");
+  auto batch_size = options.get<int>("batch_size");
+  auto batch_order = options.get<string>("batch_order", "seq");
+  auto print_every = options.get<int>("print_every");
+  auto seed = options.get<int>("seed");
+  if (variational->is_local())
+    throw runtime_error("async training only updates global parameters");
+  if (data->resident_size() < data->n_examples())
+    throw runtime_error("async training needs every example resident");
+  variational->share_params();
+
+  int next_iteration = 0;
+  vector<uint64_t> worker_iterations(workers), staleness_sum(workers),
+      staleness_max(workers);
+  auto start = chrono::steady_clock::now();
+#pragma omp parallel num_threads(workers)
+  {
+    int w = omp_get_thread_num();
+    // streams are picked by iteration, so every worker shares the seed
+    Workspace ws(*variational, n_samples, 1, seed, reparam);
+    GSLRandom batch_rng;
+    gsl_rng_set(batch_rng.rng, seed);
+    arma::uword batch_st = 0;
+    uint64_t n = 0, sum = 0, max_stale = 0;
+    for (;;) {
+      int i = __atomic_fetch_add(&next_iteration, 1, __ATOMIC_RELAXED);
+      if (i >= n_iterations)
+        break;
+      rng_set_stream(batch_rng.rng, i, n_samples);
+      // minibatch i starts where it would in synchronous training, so
+      // sequential workers never repeat one another's minibatches
+      batch_st = (arma::uword)i * batch_size % data->resident_size();
+      ExampleIds ex =
+          gen_example_ids(batch_rng.rng, batch_order, batch_size,
+                          data->resident_begin(), data->resident_size(),
+                          &batch_st);
+      uint64_t read =
+          __atomic_load_n(&variational->n_updates, __ATOMIC_RELAXED);
+      TrainStats stats(i, n_samples);
+      step_global(ws, ex, 1, stats);
+      uint64_t stale =
+          __atomic_fetch_add(&variational->n_updates, 1, __ATOMIC_RELAXED) -
+          read;
+      ++n;
+      sum += stale;
+      max_stale = max(max_stale, stale);
+      if (i % print_every == 0) {
+#pragma omp critical(print)
+        {
+          print_stats(stats);
+          variational->print();
+        }
+      }
+    }
+    worker_iterations[w] = n;
+    staleness_sum[w] = sum;
+    staleness_max[w] = max_stale;
   }
+  double seconds =
+      chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+  printf("Async training: %d workers, %d iterations in %.2fs, %.1f "
+         "iterations/s\n",
+         workers, n_iterations, seconds, n_iterations / seconds);
+  for (int w = 0; w < workers; ++w)
+    printf("  worker %d: %lu iterations, staleness mean %.2f, max %lu\n", w,
+           (unsigned long)worker_iterations[w],
+           staleness_sum[w] / max(1.0, (double)worker_iterations[w]),
+           (unsigned long)staleness_max[w]);
 }
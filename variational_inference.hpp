@@ -1,30 +1,94 @@
 #pragma once
 
+#include "allreduce.hpp"
 #include "bbvi.hpp"
+#include "checkpoint.hpp"
 #include "data.hpp"
 #include "model.hpp"
+#include "profile.hpp"
 #include "random.hpp"
+#include <omp.h>
 #include "utils.hpp"
 
+// batch_size ids among the n_resident examples from resident_begin: in
+// order from *batch_st for batch_order=seq, otherwise at random
+ExampleIds gen_example_ids(gsl_rng *rng, const string &batch_order,
+                           int batch_size, arma::uword resident_begin,
+                           arma::uword n_resident, arma::uword *batch_st);
+
 class VariationalInference {
 private:
-  vector<GSLRandom *> vec_rng;
+  // Buffers of one training thread: a philox rng per thread it runs the
+  // samples on, the latent variables and scores of every sample, one draw
+  // each, and the gradients of the global parameters, preallocated in the
+  // variational distribution's layouts. The reparameterization estimator
+  // keeps the noise and df/dz of every sample in place of the scores.
+  struct Workspace {
+    vector<shared_ptr<GSLRandom>> rngs;
+    Packed z_samples, score_samples, grads;
+    Packed noise, grad_z;
+    arma::rowvec samples_log_p, samples_log_q;
+
+    Workspace() {}
+    Workspace(const Variational &q, int n_samples, int threads, int seed,
+              bool reparam)
+        : z_samples(q.latent_layout, n_samples),
+          score_samples(q.score_layout, reparam ? 0 : n_samples),
+          grads(q.score_layout, 1),
+          noise(q.latent_layout, reparam ? n_samples : 0),
+          grad_z(q.latent_layout, reparam ? n_samples : 0),
+          samples_log_p(n_samples), samples_log_q(n_samples) {
+      for (int t = 0; t < threads; ++t) {
+        rngs.emplace_back(new GSLRandom());
+        gsl_rng_set(rngs[t]->rng, seed);
+      }
+    }
+
+    // sample s of iteration i draws from stream (i, s) of the seed, whichever
+    // thread runs it
+    gsl_rng *sample_rng(int iteration, int s) {
+      gsl_rng *rng = rngs[omp_get_thread_num()]->rng;
+      rng_set_stream(rng, iteration, s);
+      return rng;
+    }
+
+    // the batched leaves of iteration i draw from stream (i, n_samples + 1);
+    // called outside the sample loop
+    gsl_rng *batch_rng(int iteration) {
+      gsl_rng *rng = rngs[0]->rng;
+      rng_set_stream(rng, iteration, samples_log_p.n_elem + 1);
+      return rng;
+    }
+  };
+  Workspace workspace;
+  // local latents: scores [rows * B, S] of every parameter and [B, S] log
+  // p/q of the minibatch
+  vector<arma::mat> local_score;
+  arma::mat local_log_p, local_log_q;
   int iteration, n_samples, n_params;
+  // pathwise gradients instead of score-function ones
+  bool reparam;
   shared_ptr<Data> data;
+  // NULL unless several processes train together
+  shared_ptr<AllReduce> allreduce;
+  // scratch of the gradient statistics and ELBO sent along the gradients
+  arma::vec reduced_stats;
 
 protected:
   pt::ptree options;
   arma::uword n_examples;
-  ExampleIds all_examples;
-  gsl_rng *rng;
+  // minibatches of iteration i are drawn from stream (i, samples)
+  shared_ptr<GSLRandom> batch_rng;
   int threads;
-  vector<Variational::ScoreFunction> score_funcs;
   vector<Serializable<arma::mat> *> param_matrices;
   Model *model;
   Variational *variational;
 
 public:
-  VariationalInference(pt::ptree &options, Model *p, Variational *q) {
+  // data is read from data_file unless given
+  VariationalInference(pt::ptree &options, Model *p, Variational *q,
+                       shared_ptr<Data> data = NULL)
+      : data(data) {
     this->options = options;
     model = p;
     variational = q;
@@ -34,22 +98,37 @@ public:
   void init() {
     auto seed = options.get<int>("seed");
     n_samples = options.get<int>("samples");
-    vec_rng.resize(n_samples);
-    auto data_type = "dense";
+    auto data_type = options.get<string>("data_type", "dense");
     auto data_file = options.get<string>("data_file");
-    data = build_data(data_type, options, data_file);
+    allreduce = build_allreduce(options);
+    // each process only loads its own shard of the examples
+    if (!data)
+      data = allreduce ? build_data(data_type, options, data_file,
+                                    allreduce->rank(), allreduce->size())
+                       : build_data(data_type, options, data_file);
     n_examples = data->n_examples();
-    for (int i = 0; i < n_samples; ++i) {
-      vec_rng[i] = new GSLRandom();
-      gsl_rng_set(vec_rng[i]->rng, seed + i);
+    // every process draws its own samples and minibatches
+    if (allreduce)
+      seed += allreduce->rank();
+    threads = options.get<int>("n_threads");
+    auto estimator = options.get<string>("estimator", "score");
+    if (estimator != "score" && estimator != "reparam")
+      throw runtime_error("unknown gradient estimator " + estimator);
+    reparam = estimator == "reparam";
+    workspace = Workspace(*variational, n_samples, threads, seed, reparam);
+    if (variational->is_local()) {
+      auto batch_size = options.get<int>("batch_size");
+      local_score.resize(variational->param_matrices.size());
+      for (size_t k = 0; k < local_score.size(); ++k)
+        local_score[k].set_size(
+            variational->param_matrices[k]->n_rows * batch_size, n_samples);
+      local_log_p.set_size(batch_size, n_samples);
+      local_log_q.set_size(batch_size, n_samples);
     }
+    model->bind(variational->latent_layout);
     iteration = 0;
-    rng = gsl_rng_alloc(gsl_rng_taus);
-    gsl_rng_set(rng, seed);
-    all_examples.clear();
-    for (arma::uword j = 0; j < n_examples; ++j)
-      all_examples.push_back(j);
-    threads = options.get<int>("n_threads");
+    batch_rng = make_shared<GSLRandom>();
+    gsl_rng_set(batch_rng->rng, seed);
   }
 
   struct TrainStats {
@@ -60,14 +139,45 @@ public:
     vector<arma::vec> lq_z;
     vector<BBVIStats> bbvi_stats_z;
 
+    // seconds per phase; column s of sample_seconds is filled by the
+    // thread running sample s and summed into seconds at the end of a step
+    arma::vec seconds;
+    arma::mat sample_seconds;
+
     TrainStats(int iteration, int samples)
-        : iteration(iteration), elbo(samples, arma::fill::zeros) {}
+        : iteration(iteration), elbo(samples, arma::fill::zeros),
+          seconds(N_PHASES, arma::fill::zeros),
+          sample_seconds(N_PHASES, samples, arma::fill::zeros) {}
   };
 
   void print_stats(const TrainStats &);
 
+  // One JSON object per line: throughput, allocations, the seconds of every
+  // phase and the gradient statistics of an iteration.
+  void write_profile(FILE *f, const TrainStats &stats, double seconds,
+                     uint64_t allocations, size_t batch_size);
+
   void train();
 
-  /* TrainStats train_batch(const ExampleIds &example_ids); */
+  TrainStats train_batch(const ExampleIds &example_ids);
   TrainStats train_batch_global(const ExampleIds &example_ids);
+
+  // samples, scores and updates the global parameters from one minibatch
+  void step_global(Workspace &ws, const ExampleIds &example_ids, int threads,
+                   TrainStats &stats);
+
+  // copies the training state at the end of an iteration and writes it in
+  // the background
+  void save_checkpoint(Checkpointer &checkpointer, arma::uword batch_st,
+                       arma::uword n_drawn);
+  void restore_checkpoint(const TrainState &state, arma::uword &batch_st,
+                          arma::uword &n_drawn);
+
+  // averages the gradients, their statistics and the ELBO over the processes
+  void reduce_global(Workspace &ws, BBVIStats &bbvi_stats, TrainStats &stats);
+
+  // Hogwild: async.workers threads each draw their own minibatches and
+  // samples and update the shared parameters without locks, until
+  // n_iterations minibatches were used in total
+  void train_async();
 };